@@ -0,0 +1,151 @@
+// Allocations per request of the threaded server in steady state.
+//
+// Runs an httplib::Server in this process and sends it keep-alive requests
+// from one connection, counting every operator new in the process, the
+// server's threads included, once the connection is warmed up. Covers the
+// response sent from a pre-serialized head, as /capture-image sends it, and
+// one built from set_content, for requests with header values too long for
+// the small-string buffer. Exits with 1 if either allocates.
+//
+//   alloc_test [requests]
+
+#include "bench.hpp"
+
+#include "../httpd.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+
+// reads one response with a Content-Length body, without allocating
+static bool read_response(int fd)
+{
+  static char buffer[64 * 1024];
+  size_t have = 0;
+
+  for (;;)
+  {
+    ssize_t n = recv(fd, buffer + have, sizeof(buffer) - have, 0);
+
+    if (n <= 0)
+      return false;
+
+    have += n;
+
+    char *head_end = (char *)memmem(buffer, have, "\r\n\r\n", 4);
+
+    if (!head_end)
+      continue;
+
+    char *length = (char *)memmem(buffer, head_end - buffer, "Content-Length: ", 16);
+    size_t body = length ? strtoul(length + 16, nullptr, 10) : 0;
+
+    if (have >= (size_t)(head_end + 4 - buffer) + body)
+      return true;
+  }
+}
+
+static double allocations_per_request(int port, const char *path, int requests)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  sockaddr_in address{};
+
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+  {
+    perror("connect");
+    exit(2);
+  }
+
+  char request[256];
+  int length = snprintf(request, sizeof(request),
+                        "GET %s HTTP/1.1\r\n"
+                        "Host: 127.0.0.1\r\n"
+                        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) alloc_test/1.0\r\n"
+                        "Accept: text/html,application/xhtml+xml,image/webp,*/*;q=0.8\r\n"
+                        "\r\n", path);
+
+  const int warmup = 100;
+  uint64_t allocations = 0;
+
+  for (int i = 0; i < warmup + requests; i++)
+  {
+    if (i == warmup)
+      allocations = bench::allocations();
+
+    if (send(fd, request, length, 0) != length || !read_response(fd))
+    {
+      fprintf(stderr, "%s: request %d failed\n", path, i);
+      exit(2);
+    }
+  }
+
+  // the response is read once the server has sent it, but the worker may
+  // not be done with the request yet
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  double result = (double)(bench::allocations() - allocations) / requests;
+
+  close(fd);
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  int requests = argc > 1 ? std::max(1, atoi(argv[1])) : 10000;
+
+  struct Prepared
+  {
+    std::string head = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 5\r\n";
+    std::string body = "hello";
+  };
+
+  auto prepared = std::make_shared<const Prepared>();
+
+  httplib::Server svr;
+
+  svr.set_keep_alive_max_count(1000000);
+  svr.set_tcp_nodelay(true);
+
+  // as capture_image.hpp sets a frame
+  svr.Get("/serialized", [&](const httplib::Request &req, httplib::Response &res) {
+    res.set_content_provider(
+      prepared->body.size(), "text/plain",
+      [bytes = prepared->body.data()](size_t offset, size_t length, httplib::DataSink &sink) {
+        return sink.write(bytes + offset, length);
+      });
+    res.set_serialized_head(prepared, prepared->head.data(), prepared->head.size(),
+                            prepared->body.data(), prepared->body.size());
+  });
+
+  svr.Get("/content", [](const httplib::Request &req, httplib::Response &res) {
+    res.set_content("hello", "text/plain");
+  });
+
+  int port = svr.bind_to_any_port("127.0.0.1");
+  std::thread server([&] { svr.listen_after_bind(); });
+
+  svr.wait_until_ready();
+
+  double serialized = allocations_per_request(port, "/serialized", requests);
+  double content = allocations_per_request(port, "/content", requests);
+
+  svr.stop();
+  server.join();
+
+  printf("%-12s %8.2f allocs/request\n", "/serialized", serialized);
+  printf("%-12s %8.2f allocs/request\n", "/content", content);
+
+  return serialized > 0 || content > 0 ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+#ifndef _BENCH_HPP
+#define _BENCH_HPP
+
+// Shared by the benchmark programs in this directory: the logging the
+// server headers expect, a clock, percentiles and a global allocation
+// counter.
+
+#include <cstring> // for rjpg-capture.hpp
+
+#include "../rjpg-capture.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+bool verbose_debug = false;
+
+void LogErrorImpl(const std::string &msg)
+{
+  fprintf(stderr, "%s", msg.c_str());
+
+  if (msg.empty() || msg.back() != '\n')
+    fputc('\n', stderr);
+}
+
+void LogDebImp(const std::string &msg)
+{
+  LogErrorImpl(msg);
+}
+
+void ReportErrorImpl(const std::string &msg)
+{
+  LogErrorImpl(msg);
+}
+
+namespace bench {
+
+typedef std::chrono::steady_clock Clock;
+
+inline double seconds_since(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// value at fraction p (0..1) of the sorted samples
+template <class T>
+T percentile(std::vector<T> &samples, double p)
+{
+  if (samples.empty())
+    return T();
+
+  size_t index = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+// every operator new in the process, from every thread
+inline std::atomic<uint64_t> &allocations()
+{
+  static std::atomic<uint64_t> count{0};
+  return count;
+}
+
+// keeps the compiler from dropping a result it can see is unused
+template <class T>
+inline void keep(const T &value)
+{
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+} // namespace bench
+
+// counting replacements for the global allocation functions; the nothrow
+// forms call these, the over-aligned ones are not counted
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // free() pairs with the malloc() here
+#endif
+
+void *operator new(size_t size)
+{
+  bench::allocations().fetch_add(1, std::memory_order_relaxed);
+
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  std::free(p);
+}
+
+#endif
@@ -0,0 +1,507 @@
+// Load generator for a running rjpg-capture.
+//
+// Each connection sends keep-alive GETs one after another and reads the
+// whole response; the run reports requests per second and latency
+// percentiles. With -t and the server's pid, a second run of the same
+// size is made with every server thread traced by ptrace, counting the
+// system calls it entered, so the server modes can be compared by
+// syscalls per request as well as by latency. Tracing slows the server
+// down, which is why its run is separate from the timed one.
+//
+//   http_bench [-p port] [-c connections] [-n requests] [-H header] [-t pid] [path]
+//
+// e.g. /capture-image on the threaded, epoll (-E) and io_uring (-E -U)
+// servers, and with -H "Range: bytes=0-" to force the generic response
+// writer instead of the pre-serialized head.
+
+#include "bench.hpp"
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+  #include <arpa/inet.h>
+  #include <dirent.h>
+  #include <errno.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <pthread.h>
+  #include <signal.h>
+  #include <sys/ptrace.h>
+  #include <sys/socket.h>
+  #include <sys/syscall.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+}
+
+struct Options
+{
+  int port = 8080;
+  int connections = 4;
+  int requests = 2000;
+  std::string path = "/capture-image";
+  std::string headers;
+  pid_t server_pid = 0;
+};
+
+// one keep-alive connection; the buffer is reused for every response
+struct Client
+{
+  int fd = -1;
+  std::vector<char> buffer = std::vector<char>(64 * 1024);
+  std::vector<double> latencies;
+  uint64_t errors = 0;
+  uint64_t bytes = 0;
+
+  ~Client()
+  {
+    if (fd != -1)
+      ::close(fd);
+  }
+
+  bool connect(int port)
+  {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd != -1 && ::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  }
+
+  static bool send_all(int fd, const std::string &data)
+  {
+    for (size_t sent = 0; sent < data.size(); )
+    {
+      ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+
+      if (n <= 0)
+        return false;
+
+      sent += n;
+    }
+
+    return true;
+  }
+
+  // reads one response with a Content-Length body; false on a broken
+  // connection. close is set when the server ends the connection after it,
+  // as it does after the keep-alive maximum.
+  bool read_response(int &status, bool &close)
+  {
+    size_t filled = 0;
+    size_t head_end = std::string::npos;
+
+    while (head_end == std::string::npos)
+    {
+      if (filled == buffer.size())
+        return false;
+
+      ssize_t n = ::recv(fd, buffer.data() + filled, buffer.size() - filled, 0);
+
+      if (n <= 0)
+        return false;
+
+      filled += n;
+      head_end = std::string(buffer.data(), filled).find("\r\n\r\n");
+    }
+
+    std::string head(buffer.data(), head_end + 2);
+
+    for (auto &c : head)
+      c = tolower(c);
+
+    size_t length_at = head.find("\r\ncontent-length:");
+    size_t body = length_at == std::string::npos ? 0 : strtoull(head.c_str() + length_at + 17, nullptr, 10);
+
+    status = atoi(buffer.data() + 9);
+    close = head.find("\r\nconnection: close\r\n") != std::string::npos;
+
+    size_t remaining = body - std::min(body, filled - head_end - 4);
+
+    bytes += head_end + 4 + body;
+
+    while (remaining > 0)
+    {
+      ssize_t n = ::recv(fd, buffer.data(), std::min(buffer.size(), remaining), 0);
+
+      if (n <= 0)
+        return false;
+
+      remaining -= n;
+    }
+
+    return true;
+  }
+
+  void run(const Options &options, int count)
+  {
+    std::string request = "GET " + options.path + " HTTP/1.1\r\nHost: localhost\r\n" + options.headers + "\r\n";
+
+    latencies.reserve(count);
+
+    for (int i = 0; i < count; i++)
+    {
+      auto start = bench::Clock::now();
+      int status = 0;
+      bool close = false;
+
+      if ((fd == -1 && !connect(options.port)) || !send_all(fd, request) || !read_response(status, close))
+      {
+        // reconnect for the next request
+        errors++;
+        ::close(fd);
+        fd = -1;
+        continue;
+      }
+
+      latencies.push_back(bench::seconds_since(start) * 1e6);
+
+      if (close)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+
+      if (status >= 400)
+        errors++;
+    }
+  }
+};
+
+struct RunResult
+{
+  double seconds = 0;
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  uint64_t bytes = 0;
+  std::vector<double> latencies;
+};
+
+RunResult run_load(const Options &options)
+{
+  std::vector<Client> clients(options.connections);
+  std::vector<std::thread> threads;
+  RunResult result;
+  auto start = bench::Clock::now();
+
+  for (auto &client : clients)
+  {
+    threads.emplace_back([&options, &client] {
+      client.run(options, options.requests / options.connections);
+    });
+  }
+
+  for (auto &thread : threads)
+    thread.join();
+
+  result.seconds = bench::seconds_since(start);
+
+  for (auto &client : clients)
+  {
+    result.requests += client.latencies.size();
+    result.errors += client.errors;
+    result.bytes += client.bytes;
+    result.latencies.insert(result.latencies.end(), client.latencies.begin(), client.latencies.end());
+  }
+
+  return result;
+}
+
+// Counts the system calls entered by every thread of a process, from a
+// thread of its own, since only the thread that attached may drive the
+// tracees. stop() interrupts its waitpid with a signal, then every thread
+// is stopped and detached again.
+struct SyscallCounter
+{
+  pid_t _pid;
+  std::thread _thread;
+  std::atomic<bool> _stopping{false};
+  std::atomic<bool> _done{false};
+  std::atomic<bool> _attached{false};
+  std::set<pid_t> _tids;
+  std::map<uint64_t, uint64_t> _counts;
+
+  SyscallCounter(pid_t pid) : _pid(pid) {}
+
+  static void on_signal(int) {}
+
+  bool start()
+  {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal; // no SA_RESTART, so waitpid returns EINTR
+    sigaction(SIGUSR1, &action, nullptr);
+
+    _thread = std::thread([this] { trace(); });
+
+    while (!_attached && !_done)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    return _attached;
+  }
+
+  void stop()
+  {
+    _stopping = true;
+
+    while (!_done)
+    {
+      pthread_kill(_thread.native_handle(), SIGUSR1);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    _thread.join();
+  }
+
+  void attach()
+  {
+    std::string dir = "/proc/" + std::to_string(_pid) + "/task";
+    DIR *tasks = opendir(dir.c_str());
+
+    if (!tasks)
+      return;
+
+    while (struct dirent *entry = readdir(tasks))
+    {
+      pid_t tid = atoi(entry->d_name);
+      int status;
+
+      if (tid <= 0 || ptrace(PTRACE_SEIZE, tid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE) != 0)
+        continue;
+
+      ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+
+      if (waitpid(tid, &status, __WALL) == tid && WIFSTOPPED(status))
+      {
+        ptrace(PTRACE_SYSCALL, tid, 0, 0);
+        _tids.insert(tid);
+      }
+    }
+
+    closedir(tasks);
+  }
+
+  void trace()
+  {
+    attach();
+    _attached = !_tids.empty();
+
+    while (!_stopping && !_tids.empty())
+    {
+      int status;
+      pid_t tid = waitpid(-1, &status, __WALL);
+
+      if (tid < 0)
+      {
+        if (errno != EINTR)
+          break;
+        continue;
+      }
+
+      if (WIFEXITED(status) || WIFSIGNALED(status))
+      {
+        _tids.erase(tid);
+        continue;
+      }
+
+      if (!WIFSTOPPED(status))
+        continue;
+
+      int sig = WSTOPSIG(status);
+
+      _tids.insert(tid); // a new thread's first stop
+
+      if (sig == (SIGTRAP | 0x80))
+      {
+        struct __ptrace_syscall_info info;
+
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+          _counts[info.entry.nr]++;
+
+        sig = 0;
+      }
+      else if (status >> 16)
+      {
+        // clone and group stop events carry no signal to pass on
+        sig = 0;
+      }
+
+      ptrace(PTRACE_SYSCALL, tid, 0, sig);
+    }
+
+    detach();
+    _done = true;
+  }
+
+  void detach()
+  {
+    for (pid_t tid : _tids)
+      ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+
+    while (!_tids.empty())
+    {
+      int status;
+      pid_t tid = waitpid(-1, &status, __WALL);
+
+      if (tid < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+
+      if (WIFSTOPPED(status))
+      {
+        int sig = WSTOPSIG(status);
+        bool pass = sig != (SIGTRAP | 0x80) && (status >> 16) == 0;
+
+        ptrace(PTRACE_DETACH, tid, 0, pass ? sig : 0);
+      }
+
+      _tids.erase(tid);
+    }
+  }
+
+  uint64_t total() const
+  {
+    uint64_t sum = 0;
+
+    for (auto &entry : _counts)
+      sum += entry.second;
+
+    return sum;
+  }
+};
+
+static const char *syscall_name(uint64_t nr)
+{
+  static const std::map<uint64_t, const char *> names = {
+#ifdef SYS_read
+    {SYS_read, "read"},
+#endif
+#ifdef SYS_write
+    {SYS_write, "write"},
+#endif
+#ifdef SYS_poll
+    {SYS_poll, "poll"},
+#endif
+#ifdef SYS_select
+    {SYS_select, "select"},
+#endif
+    {SYS_ppoll, "ppoll"},
+    {SYS_pselect6, "pselect6"},
+    {SYS_recvfrom, "recvfrom"},
+    {SYS_sendto, "sendto"},
+    {SYS_sendmsg, "sendmsg"},
+    {SYS_recvmsg, "recvmsg"},
+    {SYS_writev, "writev"},
+    {SYS_accept4, "accept4"},
+    {SYS_setsockopt, "setsockopt"},
+    {SYS_getsockopt, "getsockopt"},
+    {SYS_getsockname, "getsockname"},
+    {SYS_getpeername, "getpeername"},
+    {SYS_close, "close"},
+    {SYS_shutdown, "shutdown"},
+    {SYS_futex, "futex"},
+    {SYS_epoll_ctl, "epoll_ctl"},
+#ifdef SYS_epoll_wait
+    {SYS_epoll_wait, "epoll_wait"},
+#endif
+    {SYS_epoll_pwait, "epoll_pwait"},
+    {SYS_io_uring_enter, "io_uring_enter"},
+    {SYS_ioctl, "ioctl"},
+    {SYS_nanosleep, "nanosleep"},
+    {SYS_clock_nanosleep, "clock_nanosleep"},
+    {SYS_mmap, "mmap"},
+    {SYS_munmap, "munmap"},
+  };
+
+  auto it = names.find(nr);
+  return it == names.end() ? nullptr : it->second;
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: http_bench [-p port] [-c connections] [-n requests] [-H header] [-t server-pid] [path]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:c:n:H:t:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'p': options.port = atoi(optarg); break;
+    case 'c': options.connections = std::max(1, atoi(optarg)); break;
+    case 'n': options.requests = std::max(1, atoi(optarg)); break;
+    case 'H': options.headers += std::string(optarg) + "\r\n"; break;
+    case 't': options.server_pid = atoi(optarg); break;
+    default: usage();
+    }
+  }
+
+  if (optind < argc)
+    options.path = argv[optind];
+
+  RunResult result = run_load(options);
+
+  printf("%s: %llu requests on %d connections in %.2f s, %.0f requests/s, %.1f MB/s, %llu errors\n",
+         options.path.c_str(), (unsigned long long)result.requests, options.connections, result.seconds,
+         result.requests / result.seconds, result.bytes / result.seconds / 1e6, (unsigned long long)result.errors);
+  printf("latency us: p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+         bench::percentile(result.latencies, 0.50), bench::percentile(result.latencies, 0.90),
+         bench::percentile(result.latencies, 0.99), bench::percentile(result.latencies, 1.0));
+
+  if (options.server_pid == 0)
+    return result.errors == 0 ? 0 : 1;
+
+  SyscallCounter counter(options.server_pid);
+
+  if (!counter.start())
+  {
+    fprintf(stderr, "could not trace process %d: %s\n", (int)options.server_pid, strerror(errno));
+    return 1;
+  }
+
+  RunResult traced = run_load(options);
+
+  counter.stop();
+
+  double per_request = traced.requests ? (double)counter.total() / traced.requests : 0;
+
+  printf("server syscalls: %llu for %llu requests, %.2f per request\n",
+         (unsigned long long)counter.total(), (unsigned long long)traced.requests, per_request);
+
+  std::vector<std::pair<uint64_t, uint64_t>> counts(counter._counts.begin(), counter._counts.end());
+
+  std::sort(counts.begin(), counts.end(), [](auto &a, auto &b) { return a.second > b.second; });
+
+  for (auto &entry : counts)
+  {
+    const char *name = syscall_name(entry.first);
+
+    if (name)
+      printf("  %-16s %8.2f per request\n", name, (double)entry.second / traced.requests);
+    else
+      printf("  syscall %-8llu %8.2f per request\n", (unsigned long long)entry.first, (double)entry.second / traced.requests);
+  }
+
+  return traced.errors == 0 && result.errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,166 @@
+// Request parse throughput: httplib's line reader, request line split and
+// read_headers, as the threaded servers parse, against FlatRequest and
+// EventServer::make_request, as the event servers do.
+//
+// Both parse from memory into a fresh Request per request, as their
+// servers do, so the numbers leave out the socket reads. Reported are the
+// time and the allocations per request for a short curl-like request and
+// a browser-like one.
+//
+//   parse_bench [iterations]
+
+#include "bench.hpp"
+
+#include "../event_server.hpp"
+
+#include <set>
+#include <string>
+
+// reads from a fixed buffer that can be rewound, so the baseline does not
+// allocate for its stream
+struct MemoryStream : public httplib::Stream
+{
+  const char *_data;
+  size_t _size;
+  size_t _position = 0;
+
+  MemoryStream(const std::string &data) : _data(data.data()), _size(data.size()) {}
+
+  void rewind() { _position = 0; }
+
+  bool is_readable() const override { return true; }
+  bool is_writable() const override { return false; }
+
+  ssize_t read(char *ptr, size_t size) override
+  {
+    size = std::min(size, _size - _position);
+    memcpy(ptr, _data + _position, size);
+    _position += size;
+    return (ssize_t)size;
+  }
+
+  ssize_t write(const char *ptr, size_t size) override { return -1; }
+  void get_remote_ip_and_port(std::string &ip, int &port) const override {}
+  void get_local_ip_and_port(std::string &ip, int &port) const override {}
+  socket_t socket() const override { return INVALID_SOCKET; }
+};
+
+// what Server::parse_request_line does, which is private to the server
+static bool parse_request_line(const char *s, httplib::Request &req)
+{
+  static const std::set<std::string> methods{"GET", "HEAD", "POST", "PUT", "DELETE",
+                                             "CONNECT", "OPTIONS", "TRACE", "PATCH", "PRI"};
+  size_t len = strlen(s);
+  size_t count = 0;
+
+  if (len < 2 || s[len - 2] != '\r' || s[len - 1] != '\n')
+    return false;
+
+  httplib::detail::split(s, s + len - 2, ' ', [&](const char *b, const char *e) {
+    switch (count++)
+    {
+    case 0: req.method = std::string(b, e); break;
+    case 1: req.target = std::string(b, e); break;
+    case 2: req.version = std::string(b, e); break;
+    }
+  });
+
+  if (count != 3 || methods.find(req.method) == methods.end())
+    return false;
+
+  if (req.version != "HTTP/1.1" && req.version != "HTTP/1.0")
+    return false;
+
+  size_t fragment = req.target.find('#');
+
+  if (fragment != std::string::npos)
+    req.target.erase(fragment);
+
+  httplib::detail::divide(req.target, '?',
+                          [&](const char *lhs, size_t lhs_size, const char *rhs, size_t rhs_size) {
+                            req.path = httplib::detail::decode_url(std::string(lhs, lhs_size), false);
+                            httplib::detail::parse_query_text(rhs, rhs_size, req.params);
+                          });
+  return true;
+}
+
+static bool parse_httplib(MemoryStream &strm)
+{
+  char line[2048];
+  httplib::Request req;
+  httplib::detail::stream_line_reader reader(strm, line, sizeof(line));
+
+  strm.rewind();
+
+  bool ok = reader.getline() && parse_request_line(reader.ptr(), req) &&
+            httplib::detail::read_headers(strm, req.headers);
+
+  bench::keep(req);
+  return ok && req.has_header("Host");
+}
+
+static bool parse_flat(const std::string &data)
+{
+  const char *begin = data.data();
+  size_t head_end = FlatRequest::find_head_end(begin, begin + data.size());
+  FlatRequest flat;
+  httplib::Request req;
+
+  bool ok = head_end != std::string::npos &&
+            flat.parse(begin, begin + head_end + 2) == FlatRequest::Ok &&
+            EventServer::make_request(flat, req);
+
+  bench::keep(req);
+  return ok && req.has_header("Host");
+}
+
+template <class Parse>
+void measure(const char *name, const char *request_name, int iterations, Parse parse)
+{
+  uint64_t allocations = bench::allocations();
+  auto start = bench::Clock::now();
+  int failed = 0;
+
+  for (int i = 0; i < iterations; i++)
+    failed += !parse();
+
+  double seconds = bench::seconds_since(start);
+
+  printf("%-8s %-8s %10.0f ns/request %12.0f requests/s %8.2f allocs/request%s\n",
+         name, request_name, seconds * 1e9 / iterations, iterations / seconds,
+         (double)(bench::allocations() - allocations) / iterations, failed ? "  PARSE FAILED" : "");
+}
+
+int main(int argc, char **argv)
+{
+  int iterations = argc > 1 ? std::max(1, atoi(argv[1])) : 200000;
+
+  const std::pair<const char *, std::string> requests[] = {
+    {"curl", "GET /capture-image HTTP/1.1\r\n"
+             "Host: camera.local:8080\r\n"
+             "User-Agent: curl/7.88.1\r\n"
+             "Accept: */*\r\n"
+             "\r\n"},
+    {"browser", "GET /capture-image?next=1&width=1280 HTTP/1.1\r\n"
+                "Host: camera.local:8080\r\n"
+                "Connection: keep-alive\r\n"
+                "Cache-Control: max-age=0\r\n"
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+                "Accept: image/avif,image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+                "Referer: http://camera.local:8080/\r\n"
+                "Accept-Encoding: gzip, deflate\r\n"
+                "Accept-Language: en-US,en;q=0.9\r\n"
+                "If-None-Match: \"65e1c1a2aa284-22\"\r\n"
+                "\r\n"},
+  };
+
+  for (auto &request : requests)
+  {
+    MemoryStream strm(request.second);
+
+    measure("httplib", request.first, iterations, [&] { return parse_httplib(strm); });
+    measure("flat", request.first, iterations, [&] { return parse_flat(request.second); });
+  }
+
+  return 0;
+}
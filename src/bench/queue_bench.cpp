@@ -0,0 +1,106 @@
+// Enqueue/dequeue throughput of the task queues a server can run its
+// connections on, at 1 to 64 threads.
+//
+// For each thread count n, n producers enqueue empty tasks the size of
+// the one httplib queues per connection onto a queue with n workers,
+// until every task has run. Reported are tasks per second, the times a
+// bounded queue refused a task (the producer then yields and retries)
+// and the allocations per task.
+//
+//   queue_bench [tasks]
+
+#include "bench.hpp"
+
+#include "../task_queue.hpp"
+
+#include <thread>
+#include <vector>
+
+struct Result
+{
+  int tasks;
+  double seconds;
+  uint64_t rejected;
+  uint64_t allocations;
+};
+
+template <class MakeQueue>
+Result run(MakeQueue make_queue, int threads, int tasks)
+{
+  std::unique_ptr<httplib::TaskQueue> queue(make_queue(threads));
+  std::atomic<int> done{0};
+  std::atomic<uint64_t> rejected{0};
+  std::vector<std::thread> producers;
+  int per_producer = tasks / threads;
+  int total = per_producer * threads;
+
+  // let the workers start before counting
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  uint64_t allocations = bench::allocations();
+  auto start = bench::Clock::now();
+
+  for (int p = 0; p < threads; p++)
+  {
+    producers.emplace_back([&] {
+      for (int i = 0; i < per_producer; i++)
+      {
+        // a pointer and an int, like httplib's [this, sock]
+        while (!queue->enqueue([&done, i] { (void)i; done.fetch_add(1, std::memory_order_relaxed); }))
+        {
+          rejected++;
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  for (auto &producer : producers)
+    producer.join();
+
+  while (done < total)
+    std::this_thread::yield();
+
+  Result result{total, bench::seconds_since(start), rejected, bench::allocations() - allocations};
+
+  queue->shutdown();
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  int tasks = argc > 1 ? std::max(1, atoi(argv[1])) : 200000;
+
+  struct Queue
+  {
+    const char *name;
+    std::function<httplib::TaskQueue *(int)> make;
+  };
+
+  std::vector<Queue> queues = {
+    {"ThreadPool", [](int n) -> httplib::TaskQueue * { return new httplib::ThreadPool(n); }},
+    {"WorkStealingQueue", [](int n) -> httplib::TaskQueue * { return new WorkStealingQueue(n); }},
+    {"ElasticThreadPool", [](int n) -> httplib::TaskQueue * {
+      ElasticThreadPool::Limits limits;
+      limits.min_workers = n;
+      limits.max_workers = n;
+      return new ElasticThreadPool(limits);
+    }},
+  };
+
+  printf("%-18s %7s %14s %10s %12s\n", "queue", "threads", "tasks/s", "rejected", "allocs/task");
+
+  for (auto &queue : queues)
+  {
+    for (int threads = 1; threads <= 64; threads *= 2)
+    {
+      Result result = run(queue.make, threads, tasks);
+
+      printf("%-18s %7d %14.0f %10llu %12.2f\n", queue.name, threads,
+             result.tasks / result.seconds, (unsigned long long)result.rejected,
+             (double)result.allocations / result.tasks);
+    }
+  }
+
+  return 0;
+}
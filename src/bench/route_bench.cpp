@@ -0,0 +1,185 @@
+// Route lookup: the RouteTrie the server now dispatches through, against
+// trying every route's matcher in registration order as it used to.
+//
+// First checks that both pick the same route and the same path params for
+// every test path, and exits with 1 if any differ. Then times the lookup
+// of each path with the application's routes and with 128 more ahead of
+// them. req.matches is not compared: routes the trie matches leave it
+// empty, where a RegexMatcher left the path in matches[0].
+//
+//   route_bench [iterations]
+
+#include "bench.hpp"
+
+#include "../httpd.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using httplib::detail::MatcherBase;
+using httplib::detail::RouteTrie;
+
+struct Routes
+{
+  std::vector<std::unique_ptr<MatcherBase>> matchers;
+  RouteTrie trie;
+
+  void add(const std::string &pattern)
+  {
+    // as Server::make_matcher and Server::add_handler
+    if (pattern.find("/:") != std::string::npos)
+      matchers.push_back(std::make_unique<httplib::detail::PathParamsMatcher>(pattern));
+    else
+      matchers.push_back(std::make_unique<httplib::detail::RegexMatcher>(pattern));
+
+    trie.add(pattern, matchers.size() - 1);
+  }
+
+  size_t find_linear(httplib::Request &req) const
+  {
+    for (size_t i = 0; i < matchers.size(); i++)
+    {
+      if (matchers[i]->match(req))
+        return i;
+    }
+
+    return RouteTrie::npos;
+  }
+
+  // as Server::dispatch_request
+  size_t find_trie(httplib::Request &req) const
+  {
+    RouteTrie::Captures captures;
+    size_t index = trie.find(req.path, captures);
+
+    for (size_t i : trie.unindexed())
+    {
+      if (i > index)
+        break;
+
+      if (matchers[i]->match(req))
+        return i;
+    }
+
+    if (index != RouteTrie::npos)
+      trie.set_path_params(index, captures, req);
+
+    return index;
+  }
+};
+
+static const char *app_routes[] = {
+  "/capture-image", "/stream", "/ws", "/events", "/stats", "/health",
+};
+
+// resource routes with params and two regex routes, as a
+// larger application would add them
+static void add_filler(Routes &routes)
+{
+  for (int i = 0; i < 32; i++)
+  {
+    std::string base = "/api/v1/resource" + std::to_string(i);
+
+    routes.add(base);
+    routes.add(base + "/:id");
+    routes.add(base + "/:id/items/:item");
+    routes.add(base + "/static/files");
+  }
+
+  routes.add(R"(/files/(\d+))");
+  routes.add(R"(/download/(.*))");
+}
+
+static const char *test_paths[] = {
+  "/capture-image", "/stream", "/ws", "/events", "/stats", "/health",
+  "/", "", "/missing", "/stats/", "/capture-image/extra", "//stats",
+  "/api/v1/resource0", "/api/v1/resource0/", "/api/v1/resource0/42",
+  "/api/v1/resource0/42/", "/api/v1/resource0/42//", "/api/v1/resource7/abc/items/9",
+  "/api/v1/resource7/abc/items/9/", "/api/v1/resource7/abc/items", "/api/v1/resource7/static/files",
+  "/api/v1/resource7/static/files/", "/api/v1/resource31/x/items/y/z", "/api/v1/resource32/1",
+  "/api/v1/resource12//items/3", "/files/123", "/files/abc", "/download/a/b/c", "/download/",
+};
+
+static bool same(const httplib::Request &a, const httplib::Request &b)
+{
+  return a.path_params == b.path_params;
+}
+
+static int check(const Routes &routes, const char *name)
+{
+  int mismatches = 0;
+
+  for (const char *path : test_paths)
+  {
+    httplib::Request linear, trie;
+
+    linear.path = trie.path = path;
+
+    size_t expected = routes.find_linear(linear);
+    size_t found = routes.find_trie(trie);
+
+    if (expected != found || (expected != RouteTrie::npos && !same(linear, trie)))
+    {
+      printf("MISMATCH %s: \"%s\" matchers chose %zd, trie chose %zd\n", name, path,
+             (ssize_t)expected, (ssize_t)found);
+      mismatches++;
+    }
+  }
+
+  return mismatches;
+}
+
+template <class Find>
+double nanoseconds_per_lookup(int iterations, Find find)
+{
+  std::vector<httplib::Request> requests(std::size(test_paths));
+
+  for (size_t i = 0; i < requests.size(); i++)
+    requests[i].path = test_paths[i];
+
+  auto start = bench::Clock::now();
+
+  for (int n = 0; n < iterations; n++)
+  {
+    for (auto &req : requests)
+    {
+      size_t index = find(req);
+      bench::keep(index);
+    }
+  }
+
+  return bench::seconds_since(start) * 1e9 / ((double)iterations * requests.size());
+}
+
+int main(int argc, char **argv)
+{
+  int iterations = argc > 1 ? std::max(1, atoi(argv[1])) : 20000;
+
+  Routes app, large;
+
+  for (const char *pattern : app_routes)
+    app.add(pattern);
+
+  add_filler(large);
+
+  for (const char *pattern : app_routes)
+    large.add(pattern);
+
+  int mismatches = check(app, "app") + check(large, "large");
+
+  if (mismatches)
+    return 1;
+
+  printf("route selection and path params agree on %zu paths\n", std::size(test_paths));
+  printf("%-6s %7s %16s %16s\n", "routes", "count", "matchers ns", "trie ns");
+
+  for (auto *routes : {&app, &large})
+  {
+    printf("%-6s %7zu %16.0f %16.0f\n", routes == &app ? "app" : "large", routes->matchers.size(),
+           nanoseconds_per_lookup(iterations, [&](httplib::Request &req) { return routes->find_linear(req); }),
+           nanoseconds_per_lookup(iterations, [&](httplib::Request &req) { return routes->find_trie(req); }));
+  }
+
+  return 0;
+}
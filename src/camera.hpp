@@ -7,6 +7,9 @@
 #include <stdexcept>
 #include <thread>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 struct Camera {
   struct ErrorOpen : public std::runtime_error
@@ -15,18 +18,90 @@ struct Camera {
   typedef std::vector<char> ImageData;
   typedef std::shared_ptr<ImageData> ImageData_h;
 
+  // a published frame; never modified after publishing so it can be
+  // shared by any number of readers without copying the image bytes
+  struct Frame
+  {
+    ImageData_h data;
+    uint64_t epoch = 0;
+    uint64_t sequence = 0;
+    std::chrono::system_clock::time_point timestamp;
+    std::chrono::steady_clock::time_point published;
+    std::chrono::steady_clock::time_point captured; // by the device, or published if it can not say
+  };
+  typedef std::shared_ptr<const Frame> Frame_h;
+
   std::thread _readerThread;
 
+  // most recently published frame, shared by every reader
+  std::mutex _frameMutex;
+  std::condition_variable _frameCond;
+  Frame_h _latestFrame;
+  uint64_t _frameSequence = 0;
+
+  // identifies this camera instance, since sequence numbers restart at 1
+  // whenever the process does; epoch and sequence together name a frame
+  uint64_t _epoch;
+
+  Camera()
+    : _epoch(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count())
+  {
+  }
+
   virtual ~Camera()
   {
   }
 
   virtual void open(const std::string &path, int width, int height) = 0;
-  virtual ImageData_h capture_frame() = 0;
   virtual bool set_control(const std::string &control_name, int32_t value) { return false; }
   virtual bool set_control(const std::string &control_name, const std::string &enum_value) { return false; }
   virtual void image_reader_loop() = 0;
 
+  // returns the latest frame, or an empty handle if none has arrived yet
+  virtual Frame_h latest_frame()
+  {
+    std::lock_guard<std::mutex> lock(_frameMutex);
+    return _latestFrame;
+  }
+
+  virtual ImageData_h capture_frame()
+  {
+    Frame_h frame = latest_frame();
+    return frame ? frame->data : ImageData_h();
+  }
+
+  virtual void publish_frame(ImageData_h data, std::chrono::steady_clock::time_point captured = {})
+  {
+    auto frame = std::make_shared<Frame>();
+
+    frame->data = data;
+    frame->epoch = _epoch;
+    frame->timestamp = std::chrono::system_clock::now();
+    frame->published = std::chrono::steady_clock::now();
+    frame->captured = captured.time_since_epoch().count() != 0 ? captured : frame->published;
+
+    {
+      std::lock_guard<std::mutex> lock(_frameMutex);
+      frame->sequence = ++_frameSequence;
+      _latestFrame = frame;
+    }
+    _frameCond.notify_all();
+  }
+
+  // blocks until a frame newer than after_sequence is available or the
+  // timeout expires, in which case an empty handle is returned
+  template <class Rep, class Period>
+  Frame_h wait_for_frame(uint64_t after_sequence, const std::chrono::duration<Rep, Period> &timeout)
+  {
+    std::unique_lock<std::mutex> lock(_frameMutex);
+
+    if (!_frameCond.wait_for(lock, timeout, [&] { return _latestFrame && _latestFrame->sequence > after_sequence; }))
+      return Frame_h();
+
+    return _latestFrame;
+  }
+
   virtual void run_reader()
   {
     _readerThread = std::thread([this] {
@@ -37,4 +112,4 @@ struct Camera {
   virtual void close() = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
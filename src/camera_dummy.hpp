@@ -1,6 +1,8 @@
 #include "camera.hpp"
 #include "rjpg-capture.hpp"
 
+#include <atomic>
+
 struct CameraDummy : public Camera
 {
   struct file_read_exception : public std::runtime_error
@@ -9,6 +11,8 @@ struct CameraDummy : public Camera
   };
 
   int image_count = 0;
+  std::atomic<bool> _alive{false};
+  static constexpr std::chrono::milliseconds frame_interval{100};
 
   static void slurp_file(std::string path, std::vector<char> &result) 
   {
@@ -38,32 +42,36 @@ struct CameraDummy : public Camera
 
   virtual void open(const std::string &path, int width, int height) override
   {
-
+    _alive = true;
   }
 
+  // publish the test images at a steady rate, like a real camera would
   virtual void image_reader_loop() override
   {
-  }
+    while (_alive)
+    {
+      try {
+        auto filename = string_format("test-images/test-image-%d.jpg", image_count++ % 10);
 
-  virtual ImageData_h capture_frame() override
-  {
-    try {
-      auto filename = string_format("test-images/test-image-%d.jpg", image_count++ % 10);
+        ImageData_h contents = std::make_shared<ImageData>();
 
-      ImageData_h contents = std::make_shared<ImageData>();
+        slurp_file(filename.c_str(), *contents);
 
-      slurp_file(filename.c_str(), *contents);
+        publish_frame(contents);
+      }
+      catch(file_read_exception &e) {
+        fprintf(stderr, "could not read file: %s\n", e.what());
+      }
 
-      return contents;
-    }
-    catch(file_read_exception e) {
-      fprintf(stderr, "could not read file: %s\n", e.what());
-      throw e;
+      std::this_thread::sleep_for(frame_interval);
     }
   }
-  
+
   virtual void close() override
   {
+    _alive = false;
 
+    if (_readerThread.joinable())
+      _readerThread.join();
   }
 };
\ No newline at end of file
@@ -27,6 +27,9 @@
 #include "rjpg-capture.hpp"
 
 #include <thread>
+#include <fstream>
+#include <sstream>
+#include <map>
 
 extern "C" {
   #include <sys/types.h>
@@ -59,11 +62,14 @@ struct Camera_V4L : public Camera
   unsigned int _height = 0;
   static constexpr int _bufferCount = 2;
   CaptureBuffer _captureBuffers[_bufferCount];
-  std::mutex _mutex;
   std::mutex _aliveMutex;
-  ImageData_h _frameBuffers[2];
-  int _activeFrame = 0;
   bool _alive = true;
+  std::string _formatCachePath;
+
+  Camera_V4L(const std::string &format_cache_path = std::string())
+    : _formatCachePath(format_cache_path)
+  {
+  }
 
   virtual ~Camera_V4L()
   {
@@ -213,6 +219,79 @@ struct Camera_V4L : public Camera
     return set_control(control_name, it->second);
   }
 
+  // result of a successful format negotiation, remembered across restarts
+  // so a restart can skip probing a device that is already configured
+  struct NegotiatedFormat
+  {
+    int requested_width = 0;
+    int requested_height = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t pixelformat = 0;
+    uint32_t field = 0;
+  };
+
+  typedef std::map<std::string, NegotiatedFormat> FormatCache;
+
+  FormatCache load_format_cache()
+  {
+    FormatCache cache;
+
+    if (_formatCachePath.empty())
+      return cache;
+
+    std::ifstream in(_formatCachePath);
+    std::string line;
+
+    while (std::getline(in, line))
+    {
+      std::istringstream fields(line);
+      std::string device;
+      NegotiatedFormat format;
+
+      if (fields >> device >> format.requested_width >> format.requested_height
+          >> format.width >> format.height >> format.pixelformat >> format.field)
+      {
+        cache[device] = format;
+      }
+    }
+
+    return cache;
+  }
+
+  void save_format_cache(const std::string &path, const NegotiatedFormat &format)
+  {
+    if (_formatCachePath.empty())
+      return;
+
+    FormatCache cache = load_format_cache();
+    cache[path] = format;
+
+    // write to the side and rename so a crash never leaves a torn cache
+    std::string temp_path = _formatCachePath + ".tmp";
+    {
+      std::ofstream out(temp_path, std::ios::trunc);
+
+      for (auto &entry : cache)
+      {
+        const NegotiatedFormat &f = entry.second;
+        out << entry.first << ' ' << f.requested_width << ' ' << f.requested_height << ' '
+            << f.width << ' ' << f.height << ' ' << f.pixelformat << ' ' << f.field << '\n';
+      }
+
+      if (!out)
+      {
+        LogError("could not write format cache %s", temp_path.c_str());
+        return;
+      }
+    }
+
+    if (::rename(temp_path.c_str(), _formatCachePath.c_str()) != 0)
+    {
+      LogError("could not replace format cache %s: %d", _formatCachePath.c_str(), errno);
+    }
+  }
+
   virtual void open(const std::string &path, int width, int height) override 
   {
     if (_fd != -1)
@@ -227,6 +306,96 @@ struct Camera_V4L : public Camera
       throw ErrorOpen("could not open camera device");
     }
 
+    NegotiatedFormat cached;
+    bool have_cached = false;
+
+    {
+      FormatCache cache = load_format_cache();
+      auto it = cache.find(path);
+
+      if (it != cache.end() && it->second.requested_width == width && it->second.requested_height == height)
+      {
+        cached = it->second;
+        have_cached = true;
+        LogDeb("%s using cached format %ux%u", path.c_str(), cached.width, cached.height);
+      }
+    }
+
+    if (!have_cached)
+    {
+      probe_device(path);
+    }
+
+    _width = width;
+    _height = height;
+
+    struct v4l2_event_subscription sub = {0};
+
+    sub.type = V4L2_EVENT_SOURCE_CHANGE;
+    try {
+    ioctl_rw(VIDIOC_SUBSCRIBE_EVENT, sub, "subscribe to change events");
+    }
+    catch(std::runtime_error e) {
+      LogError("Could not subscribe to source change event (%d), but continuing...", errno);
+    }
+
+    struct v4l2_format format = {0};
+
+    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    ioctl_rw(VIDIOC_G_FMT, format, "get current video format");
+
+    if (have_cached &&
+        format.fmt.pix.width == cached.width &&
+        format.fmt.pix.height == cached.height &&
+        format.fmt.pix.pixelformat == cached.pixelformat)
+    {
+      // the device kept the format from the last run, so skip the slow
+      // probe/commit negotiation that S_FMT triggers on UVC devices
+      LogDeb("%s already in cached format, skipping negotiation", path.c_str());
+      _width = cached.width;
+      _height = cached.height;
+    }
+    else
+    {
+      if (have_cached)
+      {
+        LogDeb("%s format changed since cached, renegotiating", path.c_str());
+      }
+
+      negotiate_format(format);
+
+      NegotiatedFormat negotiated;
+
+      negotiated.requested_width = width;
+      negotiated.requested_height = height;
+      negotiated.width = _width;
+      negotiated.height = _height;
+      negotiated.pixelformat = format.fmt.pix.pixelformat;
+      negotiated.field = format.fmt.pix.field;
+
+      save_format_cache(path, negotiated);
+    }
+
+    if (!have_cached)
+    {
+      struct v4l2_streamparm fps_config = {0};
+
+      fps_config.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+      ioctl_rw(VIDIOC_G_PARM, fps_config, "get FPS settings");
+
+      LogDeb("FPS timing %u/%u", fps_config.parm.capture.timeperframe.numerator, fps_config.parm.capture.timeperframe.denominator);
+    }
+
+    setup_buffers();
+
+    enable_streaming(true);
+  }
+
+  // verify capabilities of a device we have not seen before
+  void probe_device(const std::string &path)
+  {
     struct v4l2_capability cap;
 
     ioctl_get(VIDIOC_QUERYCAP, cap, "query capabilities");
@@ -275,26 +444,10 @@ struct Camera_V4L : public Camera
 */
     
     LogDeb("Got timing size %ux%u pixclk %llu\n", timings.bt.width, timings.bt.height, timings.bt.pixelclock);
+  }
 
-    _width = width;
-    _height = height;
-
-    struct v4l2_event_subscription sub = {0};
-
-    sub.type = V4L2_EVENT_SOURCE_CHANGE;
-    try {
-    ioctl_rw(VIDIOC_SUBSCRIBE_EVENT, sub, "subscribe to change events");
-    }
-    catch(std::runtime_error e) {
-      LogError("Could not subscribe to source change event (%d), but continuing...", errno);
-    }
-
-    struct v4l2_format format = {0};
-
-    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    ioctl_rw(VIDIOC_G_FMT, format, "get current video format");
-
+  void negotiate_format(struct v4l2_format &format)
+  {
     if (format.type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
     {
       LogError("query video format gave bad type %d", format.type);
@@ -329,16 +482,10 @@ struct Camera_V4L : public Camera
       _height = format.fmt.pix.height;
       LogDeb("Adjusting image size to %d x %d", _width, _height);
     }
+  }
 
-
-    struct v4l2_streamparm fps_config = {0};
-
-    fps_config.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    ioctl_rw(VIDIOC_G_PARM, fps_config, "get FPS settings");
-
-    LogDeb("FPS timing %u/%u", fps_config.parm.capture.timeperframe.numerator, fps_config.parm.capture.timeperframe.denominator);
-
+  void setup_buffers()
+  {
     v4l2_requestbuffers reqbuf_config;
 
     reqbuf_config.count = _bufferCount;
@@ -383,8 +530,6 @@ struct Camera_V4L : public Camera
 
       ioctl_set(VIDIOC_QBUF, buffer_config, "queue buffer");
     }
-
-    enable_streaming(true);
   }
 
   void enable_streaming(bool enable_it = true)
@@ -404,7 +549,9 @@ struct Camera_V4L : public Camera
 // for detecting bogus JPEG frames
 #define HEADERFRAME1 0xaf
 
-  virtual void read_image_bytes(ImageData_h &data)
+  // captured is left alone unless the driver stamps buffers with the
+  // monotonic clock, which is the steady clock's
+  virtual void read_image_bytes(ImageData_h &data, std::chrono::steady_clock::time_point &captured)
   {
     // enable_streaming(true);
 
@@ -437,24 +584,17 @@ struct Camera_V4L : public Camera
     data->resize(buffer_config.bytesused);
     memcpy(&data->front(), _captureBuffers[buffer_config.index].start, buffer_config.bytesused);
 
+    if ((buffer_config.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    {
+      captured = std::chrono::steady_clock::time_point(
+        std::chrono::seconds(buffer_config.timestamp.tv_sec) + std::chrono::microseconds(buffer_config.timestamp.tv_usec));
+    }
+
     ioctl_set(VIDIOC_QBUF, buffer_config, "requeue buffer");
 
     // enable_streaming(false);
   }
 
-  virtual ImageData_h capture_frame() override
-  {
-    std::lock_guard<std::mutex> lock(_mutex);
-    return _frameBuffers[_activeFrame];
-  }
-
-  virtual void publish_frame(ImageData_h data)
-  {
-    std::lock_guard<std::mutex> lock(_mutex);
-    _activeFrame = !_activeFrame;
-    _frameBuffers[_activeFrame] = data;
-  }
-
   virtual void image_reader_loop() override
   {
     for( ; ; )
@@ -466,12 +606,14 @@ struct Camera_V4L : public Camera
           return;
 
         ImageData_h data = std::make_shared<ImageData>();
-        read_image_bytes(data);
+        std::chrono::steady_clock::time_point captured;
+
+        read_image_bytes(data, captured);
 
         if (data->empty())
           continue;
 
-        publish_frame(data);
+        publish_frame(data, captured);
       }
       catch(std::runtime_error &e)
       {
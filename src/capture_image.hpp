@@ -0,0 +1,365 @@
+#ifndef _CAPTURE_IMAGE_HPP
+#define _CAPTURE_IMAGE_HPP
+
+#include "httpd.hpp"
+#include "camera.hpp"
+#include "rjpg-capture.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+extern "C" {
+  #include <time.h>
+}
+
+// Serves the latest camera frame as a single JPEG on /capture-image.
+//
+// Every frame carries an ETag made of the camera epoch and its sequence
+// number, plus a Last-Modified date, so clients polling faster than the
+// camera produces frames can revalidate instead of downloading the same
+// image again. A conditional request for the frame the client already has
+// is answered with 304 from the frame's identity alone, without touching
+// the image bytes.
+//
+// A preparer thread builds each frame's response once: validators and the
+// complete serialized response head, with the camera's image buffer as the
+// body. Every request for that frame shares it, and long-polling clients
+// (?next=1) all wait on the same condition and are answered from the same
+// prepared response once the next frame is in, so the per-frame work does
+// not grow with the number of waiters.
+struct CaptureImage
+{
+  static constexpr std::chrono::seconds long_poll_timeout{10};
+
+  // a frame's response, built once and shared by every request for it
+  struct Prepared
+  {
+    Camera::Frame_h frame;
+    std::string etag;
+    std::string last_modified;
+    std::string head; // status line and headers of the full 200 response
+  };
+  typedef std::shared_ptr<const Prepared> Prepared_h;
+
+  Camera &_camera;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  Prepared_h _prepared;
+  std::atomic<bool> _running{true};
+  std::thread _preparerThread;
+
+  // also receives every prepared frame, e.g. to answer another server's waiters
+  std::mutex _sinkMutex;
+  std::function<void(const Prepared_h &)> _preparedSink;
+
+  std::atomic<uint64_t> _served{0};
+  std::atomic<uint64_t> _notModified{0};
+  std::atomic<uint64_t> _unavailable{0};
+  std::atomic<uint64_t> _preparedFrames{0};
+  std::atomic<uint64_t> _longPolls{0};
+  std::atomic<uint64_t> _serialized{0};
+  std::atomic<uint64_t> _abandoned{0};
+
+  CaptureImage(Camera &camera) : _camera(camera)
+  {
+    _preparerThread = std::thread([this] {
+      preparer_loop();
+    });
+  }
+
+  ~CaptureImage()
+  {
+    _running = false;
+
+    if (_preparerThread.joinable())
+      _preparerThread.join();
+  }
+
+  static std::string etag(const Camera::Frame &frame)
+  {
+    return string_format("\"%llx-%llu\"", (unsigned long long)frame.epoch, (unsigned long long)frame.sequence);
+  }
+
+  static std::string http_date(std::chrono::system_clock::time_point when)
+  {
+    time_t t = std::chrono::system_clock::to_time_t(when);
+    struct tm tm;
+    char buf[64];
+
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+  }
+
+  static bool parse_http_date(const std::string &value, std::chrono::system_clock::time_point &when)
+  {
+    struct tm tm = {0};
+    const char *end = strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if (!end || *end != '\0')
+      return false;
+
+    when = std::chrono::system_clock::from_time_t(timegm(&tm));
+    return true;
+  }
+
+  // If-None-Match is a comma separated list of tags or "*"; the comparison
+  // is the weak one, so a W/ prefix is ignored
+  static bool etag_matches(const std::string &header, const std::string &tag)
+  {
+    size_t pos = 0;
+
+    while (pos < header.size())
+    {
+      size_t comma = header.find(',', pos);
+      size_t end = comma == std::string::npos ? header.size() : comma;
+      size_t begin = header.find_first_not_of(" \t", pos);
+
+      if (begin < end)
+      {
+        size_t last = header.find_last_not_of(" \t", end - 1);
+        std::string candidate = header.substr(begin, last - begin + 1);
+
+        if (candidate.compare(0, 2, "W/") == 0)
+          candidate.erase(0, 2);
+
+        if (candidate == "*" || candidate == tag)
+          return true;
+      }
+
+      pos = end + 1;
+    }
+
+    return false;
+  }
+
+  static bool not_modified(const httplib::Request &req, const Prepared &prepared)
+  {
+    // If-None-Match takes precedence when both are sent
+    if (req.has_header("If-None-Match"))
+      return etag_matches(req.get_header_value("If-None-Match"), prepared.etag);
+
+    std::chrono::system_clock::time_point since;
+
+    // Last-Modified is the frame time cut to the second, so compare at that
+    // resolution (RFC 9110 13.1.3); frames within one second differ only
+    // by their ETag
+    if (req.has_header("If-Modified-Since") &&
+        parse_http_date(req.get_header_value("If-Modified-Since"), since))
+      return std::chrono::time_point_cast<std::chrono::seconds>(prepared.frame->timestamp) <= since;
+
+    return false;
+  }
+
+  static Prepared_h prepare(const Camera::Frame_h &frame)
+  {
+    auto prepared = std::make_shared<Prepared>();
+
+    prepared->frame = frame;
+    prepared->etag = etag(*frame);
+    prepared->last_modified = http_date(frame->timestamp);
+    prepared->head = string_format("HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: image/jpeg\r\n"
+                                   "Content-Length: %zu\r\n"
+                                   "ETag: %s\r\n"
+                                   "Last-Modified: %s\r\n"
+                                   "Cache-Control: no-cache\r\n"
+                                   "\r\n",
+                                   frame->data->size(), prepared->etag.c_str(), prepared->last_modified.c_str());
+    return prepared;
+  }
+
+  void set_prepared_sink(std::function<void(const Prepared_h &)> sink)
+  {
+    std::lock_guard<std::mutex> lock(_sinkMutex);
+    _preparedSink = sink;
+  }
+
+  void preparer_loop()
+  {
+    uint64_t last_sequence = 0;
+
+    while (_running)
+    {
+      Camera::Frame_h frame = _camera.wait_for_frame(last_sequence, std::chrono::seconds(1));
+
+      if (!frame)
+        continue;
+
+      last_sequence = frame->sequence;
+
+      if (!frame->data || frame->data->empty())
+        continue;
+
+      Prepared_h prepared = prepare(frame);
+
+      _preparedFrames++;
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _prepared = prepared;
+      }
+      _cond.notify_all();
+
+      std::function<void(const Prepared_h &)> sink;
+      {
+        std::lock_guard<std::mutex> lock(_sinkMutex);
+        sink = _preparedSink;
+      }
+
+      if (sink)
+        sink(prepared);
+    }
+  }
+
+  Prepared_h latest()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _prepared;
+  }
+
+  // blocks until a frame newer than after_sequence is prepared; every
+  // waiter is woken by the same notify and gets the same response
+  Prepared_h wait_newer(uint64_t after_sequence, std::chrono::seconds timeout)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _cond.wait_for(lock, timeout, [&] { return _prepared && _prepared->frame->sequence > after_sequence; });
+    return _prepared;
+  }
+
+  static bool wants_next(const httplib::Request &req)
+  {
+    return req.method == "GET" && req.has_param("next") && req.get_param_value("next") != "0";
+  }
+
+  // true if the client asked for the next frame and does not have a
+  // newer one than current yet
+  static bool should_wait(const httplib::Request &req, const Prepared &current)
+  {
+    if (!wants_next(req))
+      return false;
+
+    return !req.has_header("If-None-Match") || not_modified(req, current);
+  }
+
+  // the body is the camera's buffer, handed out without a copy; unless a
+  // range is asked for, the prepared head goes out with it as it is, in the
+  // same write, and the headers are not built per request
+  static void set_frame_content(httplib::Response &res, const Prepared_h &prepared)
+  {
+    const Camera::ImageData &data = *prepared->frame->data;
+
+    // the serialized head below makes the response own prepared, so the
+    // provider can point at the frame; a std::function holding a shared_ptr
+    // would allocate for every request
+    res.set_content_provider(
+      data.size(), "image/jpeg",
+      [bytes = data.data()](size_t offset, size_t length, httplib::DataSink &sink) {
+        return sink.write(bytes + offset, length);
+      });
+
+    // without the blank line, the server adds its connection header
+    res.set_serialized_head(prepared, prepared->head.data(), prepared->head.size() - 2,
+                            data.data(), data.size());
+  }
+
+  // counted is false for an answer that is only sent if a long poll times out
+  void respond(const httplib::Request &req, httplib::Response &res, const Prepared_h &prepared, bool counted = true)
+  {
+    res.set_header("ETag", prepared->etag);
+    res.set_header("Last-Modified", prepared->last_modified);
+    res.set_header("Cache-Control", "no-cache");
+
+    if (not_modified(req, *prepared))
+    {
+      _notModified += counted;
+      res.status = httplib::StatusCode::NotModified_304;
+      return;
+    }
+
+    _served += counted;
+    _serialized += counted && req.ranges.empty();
+    set_frame_content(res, prepared);
+  }
+
+  void respond_unavailable(httplib::Response &res)
+  {
+    // camera is still starting up
+    _unavailable++;
+    res.status = httplib::StatusCode::ServiceUnavailable_503;
+    res.set_header("Retry-After", "1");
+  }
+
+  // for the thread-per-connection servers, where waiting blocks a worker
+  void serve(const httplib::Request &req, httplib::Response &res)
+  {
+    Prepared_h prepared = latest();
+
+    if (!prepared)
+    {
+      respond_unavailable(res);
+      return;
+    }
+
+    if (should_wait(req, *prepared))
+    {
+      _longPolls++;
+      prepared = wait_newer(prepared->frame->sequence, long_poll_timeout);
+
+      // nobody left to send the frame to
+      if (req.is_connection_closed())
+      {
+        _abandoned++;
+        return;
+      }
+    }
+
+    respond(req, res, prepared);
+  }
+
+  // for the event servers: returns true to park the connection until the
+  // next prepared frame is published, with res as the answer on timeout
+  bool serve_event(const httplib::Request &req, httplib::Response &res)
+  {
+    Prepared_h prepared = latest();
+
+    if (!prepared)
+    {
+      respond_unavailable(res);
+      return false;
+    }
+
+    bool wait = should_wait(req, *prepared);
+
+    if (wait)
+      _longPolls++;
+
+    respond(req, res, prepared, !wait);
+    return wait;
+  }
+
+  std::string stats()
+  {
+    std::ostringstream out;
+
+    out << "rjpg_capture_responses_total{status=\"200\"} " << _served << "\n";
+    out << "rjpg_capture_responses_total{status=\"304\"} " << _notModified << "\n";
+    out << "rjpg_capture_responses_total{status=\"503\"} " << _unavailable << "\n";
+    out << "rjpg_capture_prepared_frames_total " << _preparedFrames << "\n";
+    out << "rjpg_capture_long_polls_total " << _longPolls << "\n";
+    out << "rjpg_capture_serialized_responses_total " << _serialized << "\n";
+    out << "rjpg_capture_abandoned_long_polls_total " << _abandoned << "\n";
+
+    return out.str();
+  }
+};
+
+#endif
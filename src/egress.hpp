@@ -0,0 +1,115 @@
+#ifndef _EGRESS_HPP
+#define _EGRESS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// one connection's part of the egress budget
+struct EgressShare
+{
+  double deficit = 0; // bytes it may still send, distributor thread only
+  std::atomic<uint64_t> allocated{0};
+  std::atomic<uint64_t> used{0}; // counted by the sender once written
+  std::atomic<uint64_t> dropped{0};
+};
+
+// Holds the streams to a total bytes/s budget with deficit round robin.
+//
+// Every frame is one round over the connections ready for a frame; one
+// still writing its last frame sits the round out, leaving its share to
+// the others. The budget earned since the previous round is split evenly
+// over the ready connections and added to each one's deficit. A
+// connection gets the frame if its deficit covers the frame and the
+// shared bucket still holds that many bytes, and otherwise the frame is
+// dropped for it, not queued. Where a round starts rotates, so when the
+// bucket runs short it is not always the same connections that miss out.
+// Deficits are capped at two frames, so a connection can not save up for
+// a burst.
+struct EgressGovernor
+{
+  double _budget; // bytes per second, 0 for no limit
+  double _tokens = 0;
+  bool _started = false;
+  std::chrono::steady_clock::time_point _last;
+  size_t _next = 0;
+
+  std::atomic<uint64_t> _grantedBytes{0};
+  std::atomic<uint64_t> _droppedFrames{0};
+
+  EgressGovernor(double bytes_per_sec = 0) : _budget(bytes_per_sec) {}
+
+  bool enabled() const { return _budget > 0; }
+
+  // decides for each share whether it gets a part of the given size;
+  // called from the distributor thread only
+  void round(const std::vector<EgressShare *> &shares, size_t bytes, std::vector<bool> &send)
+  {
+    auto now = std::chrono::steady_clock::now();
+    double earned = _started ? _budget * std::chrono::duration<double>(now - _last).count() : bytes;
+    size_t n = shares.size();
+
+    _started = true;
+    _last = now;
+    _tokens = std::min(std::max(_budget, (double)bytes), _tokens + earned);
+
+    send.assign(n, false);
+
+    if (n == 0)
+      return;
+
+    double quantum = earned / n;
+    double cap = 2.0 * std::max((double)bytes, quantum);
+
+    for (size_t i = 0; i < n; i++)
+    {
+      size_t index = (_next + i) % n;
+      EgressShare &share = *shares[index];
+
+      share.deficit = std::min(cap, share.deficit + quantum);
+      share.allocated += (uint64_t)quantum;
+
+      if (share.deficit >= bytes && _tokens >= bytes)
+      {
+        share.deficit -= bytes;
+        _tokens -= bytes;
+        _grantedBytes += bytes;
+        send[index] = true;
+      }
+      else
+      {
+        share.dropped++;
+        _droppedFrames++;
+      }
+    }
+
+    _next = (_next + 1) % n;
+  }
+
+  std::string stats() const
+  {
+    std::ostringstream out;
+
+    out << "rjpg_egress_budget_bytes_per_second " << (uint64_t)_budget << "\n";
+    out << "rjpg_egress_granted_bytes_total " << _grantedBytes << "\n";
+    out << "rjpg_egress_dropped_frames_total " << _droppedFrames << "\n";
+
+    return out.str();
+  }
+
+  static std::string share_stats(const std::string &client, const EgressShare &share)
+  {
+    std::ostringstream out;
+
+    out << "rjpg_egress_client_allocated_bytes_total{client=\"" << client << "\"} " << share.allocated << "\n";
+    out << "rjpg_egress_client_used_bytes_total{client=\"" << client << "\"} " << share.used << "\n";
+    out << "rjpg_egress_client_dropped_frames_total{client=\"" << client << "\"} " << share.dropped << "\n";
+
+    return out.str();
+  }
+};
+
+#endif
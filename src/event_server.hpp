@@ -0,0 +1,1177 @@
+#ifndef _EVENT_SERVER_HPP
+#define _EVENT_SERVER_HPP
+
+#include "httpd.hpp"
+#include "rjpg-capture.hpp"
+#include "request_parser.hpp"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+extern "C" {
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <sys/socket.h>
+  #include <sys/uio.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <pthread.h>
+  #include <sched.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+}
+
+// Non-blocking HTTP server built on edge-triggered epoll.
+//
+// httplib::Server pins a worker thread to every connection for as long as
+// it is kept alive or streaming. This server instead runs one event loop per
+// core, each owning the connections it accepted, so thousands of idle or
+// streaming connections cost only their buffers.
+//
+// Simple routes use the same Get(pattern, handler) API as httplib::Server
+// and run directly on the loop thread, so they must not block. Stream routes
+// answer with headers only and then keep the connection open; every message
+// later published to the route's channel is written to it. Like the
+// threaded stream writer, a connection still busy writing one message keeps
+// only the newest pending message and counts the ones it skipped.
+//
+// Wait routes are long polls: the handler either answers at once or parks
+// the connection, which is then answered with the next message published
+// to the route's channel, itself a complete response. Every parked
+// connection shares that one message, so answering them costs only the
+// socket writes.
+struct EventServer
+{
+  typedef httplib::Server::Handler Handler;
+
+  // returns true to wait for the channel's next message; res is then the
+  // answer sent if none arrives within the wait timeout
+  typedef std::function<bool(const httplib::Request &, httplib::Response &)> WaitHandler;
+
+  // returns true if the client already has the channel's latest message,
+  // e.g. from an earlier connection, so it is not sent again
+  typedef std::function<bool(const httplib::Request &)> ResumeHandler;
+
+  // a piece of response data, kept alive by its owner until written
+  struct Buffer
+  {
+    std::shared_ptr<const void> owner;
+    const char *data = nullptr;
+    size_t size = 0;
+  };
+  typedef std::vector<Buffer> Message;
+  typedef std::shared_ptr<const Message> Message_h;
+
+  struct Channel
+  {
+    std::mutex mutex;
+    Message_h latest;
+    uint64_t sequence = 0;
+  };
+  typedef std::shared_ptr<Channel> Channel_h;
+
+  struct Route
+  {
+    std::unique_ptr<httplib::detail::MatcherBase> matcher;
+    Handler handler;
+    Channel_h channel; // set for stream and wait routes
+    WaitHandler wait_handler;
+    ResumeHandler resume_handler;
+  };
+
+  struct Connection
+  {
+    int fd = -1;
+    std::string remote_addr;
+    int remote_port = 0;
+    std::string local_addr;
+    int local_port = 0;
+
+    std::string in;
+    size_t in_offset = 0; // start of the first request not yet handled
+    std::deque<Buffer> out;
+    size_t out_offset = 0;
+    size_t request_count = 0;
+    bool close_after_write = false;
+    std::chrono::steady_clock::time_point last_active;
+
+    Channel_h channel;
+    uint64_t channel_sequence = 0;
+    Message_h pending;
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+
+    // parked on a wait route until the next message or the timeout
+    bool waiting = false;
+    bool close_after_wait = false;
+    std::chrono::steady_clock::time_point wait_started;
+    std::deque<Buffer> wait_timeout;
+
+    virtual ~Connection() {}
+  };
+
+  struct Loop
+  {
+    int index = 0;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::thread thread;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::unordered_set<Connection *> streams;
+    std::atomic<size_t> connection_count{0};
+    std::atomic<size_t> stream_count{0};
+    std::atomic<size_t> waiting_count{0};
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> parse_ns{0};
+
+    virtual ~Loop() {}
+  };
+
+  static constexpr size_t read_chunk_size = 16 * 1024;
+  static constexpr size_t max_body_size = 64 * 1024; // no route reads one
+  static constexpr int max_events = 256;
+  static constexpr int max_iov = 64;
+
+  std::vector<Route> _routes;
+  httplib::detail::RouteTrie _routeIndex; // by index into _routes
+  std::map<std::string, Channel_h> _channels;
+  std::vector<std::unique_ptr<Loop>> _loops;
+  std::mutex _loopsMutex; // publishers wake the loops while they are built and closed
+  int _loopCount;
+  int _listenFd = -1;
+  std::atomic<bool> _running{false};
+  std::atomic<bool> _stopping{false};
+  time_t _keepAliveTimeoutSec = CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND;
+  size_t _keepAliveMaxCount = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
+  time_t _writeTimeoutSec = CPPHTTPLIB_SERVER_WRITE_TIMEOUT_SECOND;
+  time_t _waitTimeoutSec = 10;
+
+  EventServer(int loop_count = 0)
+    : _loopCount(loop_count > 0 ? loop_count : (int)std::max(1u, std::thread::hardware_concurrency()))
+  {
+  }
+
+  ~EventServer()
+  {
+    stop();
+
+    if (_listenFd != -1)
+      ::close(_listenFd);
+  }
+
+  static std::unique_ptr<httplib::detail::MatcherBase> make_matcher(const std::string &pattern)
+  {
+    if (pattern.find("/:") != std::string::npos)
+      return std::unique_ptr<httplib::detail::MatcherBase>(new httplib::detail::PathParamsMatcher(pattern));
+
+    return std::unique_ptr<httplib::detail::MatcherBase>(new httplib::detail::RegexMatcher(pattern));
+  }
+
+  void add_route(const std::string &pattern, Route &&route)
+  {
+    _routes.push_back(std::move(route));
+    _routeIndex.add(pattern, _routes.size() - 1);
+  }
+
+  EventServer &Get(const std::string &pattern, Handler handler)
+  {
+    add_route(pattern, Route{make_matcher(pattern), std::move(handler), nullptr, nullptr});
+    return *this;
+  }
+
+  // the handler sets status and headers, and a body to send ahead of the
+  // messages if it likes; on 200 the connection then receives the latest
+  // and every later message published to channel_name
+  EventServer &Stream(const std::string &pattern, const std::string &channel_name, Handler handler,
+                      ResumeHandler resume_handler = nullptr)
+  {
+    add_route(pattern, Route{make_matcher(pattern), std::move(handler), channel(channel_name), nullptr,
+                             std::move(resume_handler)});
+    return *this;
+  }
+
+  EventServer &set_wait_timeout(time_t sec)
+  {
+    _waitTimeoutSec = sec;
+    return *this;
+  }
+
+  // a long poll answered by the next message published to channel_name
+  EventServer &Wait(const std::string &pattern, const std::string &channel_name, WaitHandler handler)
+  {
+    add_route(pattern, Route{make_matcher(pattern), nullptr, channel(channel_name), std::move(handler)});
+    return *this;
+  }
+
+  Channel_h channel(const std::string &name)
+  {
+    auto it = _channels.find(name);
+
+    if (it != _channels.end())
+      return it->second;
+
+    auto created = std::make_shared<Channel>();
+    _channels[name] = created;
+    return created;
+  }
+
+  // safe to call from any thread once routes are registered
+  void publish(const std::string &channel_name, Message_h message)
+  {
+    auto it = _channels.find(channel_name);
+
+    if (it == _channels.end())
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(it->second->mutex);
+      it->second->latest = message;
+      it->second->sequence++;
+    }
+
+    wake_all();
+  }
+
+  void wake_all()
+  {
+    std::lock_guard<std::mutex> lock(_loopsMutex);
+
+    for (auto &loop : _loops)
+    {
+      wake(*loop);
+    }
+  }
+
+  void add_loop(std::unique_ptr<Loop> &&loop)
+  {
+    std::lock_guard<std::mutex> lock(_loopsMutex);
+    _loops.push_back(std::move(loop));
+  }
+
+  // a publisher may still be waking the loops until the last one is closed
+  void close_wake_fds()
+  {
+    std::lock_guard<std::mutex> lock(_loopsMutex);
+
+    for (auto &loop : _loops)
+    {
+      if (loop->wake_fd != -1)
+        ::close(loop->wake_fd);
+
+      loop->wake_fd = -1;
+    }
+  }
+
+  // when a loop could not be created: closes what the loops built so far
+  // opened, and sets _stopping so wait_until_ready() returns
+  void abandon_loops()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_loopsMutex);
+
+      for (auto &loop : _loops)
+      {
+        if (loop->epoll_fd != -1)
+          ::close(loop->epoll_fd);
+
+        loop->epoll_fd = -1;
+      }
+    }
+
+    close_wake_fds();
+    _stopping = true;
+  }
+
+  bool bind_to_port(const std::string &host, int port)
+  {
+    _listenFd = httplib::detail::create_socket(
+      host, std::string(), port, AF_UNSPEC, 0, false, false, httplib::default_socket_options,
+      [](socket_t sock, struct addrinfo &ai, bool &quit) -> bool {
+        if (::bind(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen))) { return false; }
+        if (::listen(sock, SOMAXCONN)) { return false; }
+        return true;
+      });
+
+    if (_listenFd == -1)
+      return false;
+
+    httplib::detail::set_nonblocking(_listenFd, true);
+    return true;
+  }
+
+  bool listen(const std::string &host, int port)
+  {
+    return bind_to_port(host, port) && listen_after_bind();
+  }
+
+  bool listen_after_bind()
+  {
+    if (_listenFd == -1 || _stopping)
+      return false;
+
+    for (int i = 0; i < _loopCount; i++)
+    {
+      auto loop = std::unique_ptr<Loop>(new Loop);
+
+      loop->index = i;
+      loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+      if (loop->epoll_fd == -1 || loop->wake_fd == -1)
+      {
+        LogError("could not create event loop %d: %d", i, errno);
+        add_loop(std::move(loop));
+        abandon_loops();
+        return false;
+      }
+
+      epoll_add(*loop, loop->wake_fd, EPOLLIN);
+
+      // every loop accepts; EPOLLEXCLUSIVE wakes just one of them per connection
+      epoll_add(*loop, _listenFd, EPOLLIN | EPOLLEXCLUSIVE);
+
+      add_loop(std::move(loop));
+    }
+
+    _running = true;
+
+    for (auto &loop : _loops)
+    {
+      Loop *l = loop.get();
+      l->thread = std::thread([this, l] { run_loop(*l); });
+      pin_to_core(*l);
+    }
+
+    for (auto &loop : _loops)
+    {
+      loop->thread.join();
+    }
+
+    for (auto &loop : _loops)
+    {
+      for (auto &entry : loop->connections)
+        ::close(entry.first);
+
+      loop->connections.clear();
+      loop->streams.clear();
+      ::close(loop->epoll_fd);
+    }
+
+    close_wake_fds();
+
+    _running = false;
+    return true;
+  }
+
+  bool is_running() const { return _running; }
+
+  void wait_until_ready() const
+  {
+    while (!_running && !_stopping)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+  }
+
+  void stop()
+  {
+    _stopping = true;
+    wake_all();
+  }
+
+  std::string stats()
+  {
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(_loopsMutex);
+
+    for (auto &loop : _loops)
+    {
+      out << "rjpg_event_loop_connections{loop=\"" << loop->index << "\"} " << loop->connection_count << "\n";
+      out << "rjpg_event_loop_streams{loop=\"" << loop->index << "\"} " << loop->stream_count << "\n";
+      out << "rjpg_event_loop_waiting{loop=\"" << loop->index << "\"} " << loop->waiting_count << "\n";
+      out << "rjpg_event_loop_accepted_total{loop=\"" << loop->index << "\"} " << loop->accepted << "\n";
+      out << "rjpg_event_loop_requests_total{loop=\"" << loop->index << "\"} " << loop->requests << "\n";
+      out << "rjpg_event_loop_request_parse_seconds_total{loop=\"" << loop->index << "\"} " << loop->parse_ns / 1e9 << "\n";
+      out << "rjpg_event_loop_dropped_messages_total{loop=\"" << loop->index << "\"} " << loop->dropped << "\n";
+    }
+
+    return out.str();
+  }
+
+  static void epoll_add(Loop &loop, int fd, uint32_t events)
+  {
+    struct epoll_event ev = {0};
+
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+      LogError("epoll_ctl add of fd %d failed: %d", fd, errno);
+    }
+  }
+
+  // with _loopsMutex held
+  static void wake(Loop &loop)
+  {
+    uint64_t one = 1;
+
+    if (loop.wake_fd == -1)
+      return;
+
+    if (::write(loop.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+      LogError("could not wake event loop %d: %d", loop.index, errno);
+    }
+  }
+
+  void pin_to_core(Loop &loop)
+  {
+    unsigned cores = std::thread::hardware_concurrency();
+
+    if (cores == 0)
+      return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(loop.index % cores, &cpus);
+
+    if (pthread_setaffinity_np(loop.thread.native_handle(), sizeof(cpus), &cpus) != 0)
+    {
+      LogDeb("could not pin event loop %d to core %u", loop.index, loop.index % cores);
+    }
+  }
+
+  void run_loop(Loop &loop)
+  {
+    struct epoll_event events[max_events];
+    auto last_sweep = std::chrono::steady_clock::now();
+
+    while (!_stopping)
+    {
+      int count = epoll_wait(loop.epoll_fd, events, max_events, 1000);
+
+      if (count < 0 && errno != EINTR)
+      {
+        LogError("epoll_wait failed in loop %d: %d", loop.index, errno);
+        break;
+      }
+
+      for (int i = 0; i < count; i++)
+      {
+        int fd = events[i].data.fd;
+
+        if (fd == _listenFd)
+        {
+          accept_connections(loop);
+        }
+        else if (fd == loop.wake_fd)
+        {
+          uint64_t value;
+          while (::read(loop.wake_fd, &value, sizeof(value)) > 0) {}
+
+          deliver_messages(loop);
+        }
+        else
+        {
+          handle_connection_event(loop, fd, events[i].events);
+        }
+      }
+
+      auto now = std::chrono::steady_clock::now();
+
+      if (now - last_sweep >= std::chrono::seconds(1))
+      {
+        sweep_idle(loop, now);
+        last_sweep = now;
+      }
+    }
+  }
+
+  void accept_connections(Loop &loop)
+  {
+    // bounded so one loop cannot starve its existing connections
+    for (int i = 0; i < 64; i++)
+    {
+      int fd = accept4(_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+      if (fd == -1)
+      {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+          LogError("accept failed in loop %d: %d", loop.index, errno);
+        }
+        return;
+      }
+
+      auto conn = std::unique_ptr<Connection>(new Connection);
+
+      conn->fd = fd;
+      conn->last_active = std::chrono::steady_clock::now();
+      httplib::detail::get_remote_ip_and_port(fd, conn->remote_addr, conn->remote_port);
+      httplib::detail::get_local_ip_and_port(fd, conn->local_addr, conn->local_port);
+
+      loop.connections[fd] = std::move(conn);
+      loop.connection_count++;
+      loop.accepted++;
+
+      epoll_add(loop, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+  }
+
+  void close_connection(Loop &loop, int fd)
+  {
+    auto it = loop.connections.find(fd);
+
+    if (it == loop.connections.end())
+      return;
+
+    Connection *conn = it->second.get();
+
+    if (conn->waiting)
+    {
+      loop.streams.erase(conn);
+      loop.waiting_count--;
+    }
+    else if (conn->channel)
+    {
+      loop.streams.erase(conn);
+      loop.stream_count--;
+      LogDeb("event stream client %s:%d disconnected after %llu messages, %llu dropped",
+        conn->remote_addr.c_str(), conn->remote_port,
+        (unsigned long long)conn->sent, (unsigned long long)conn->dropped);
+    }
+
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    loop.connections.erase(it);
+    loop.connection_count--;
+  }
+
+  void handle_connection_event(Loop &loop, int fd, uint32_t events)
+  {
+    auto it = loop.connections.find(fd);
+
+    if (it == loop.connections.end())
+      return;
+
+    Connection &conn = *it->second;
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+      close_connection(loop, fd);
+      return;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP))
+    {
+      bool eof = false;
+
+      // requests that arrived before the peer's FIN are still answered;
+      // still flush what is queued, e.g. an error response
+      if (!read_input(conn, eof) || !process_requests(loop, conn) || eof)
+        conn.close_after_write = true;
+    }
+
+    if (!flush(loop, conn))
+    {
+      close_connection(loop, fd);
+    }
+  }
+
+  // drains the socket, as edge triggering requires; false on an error,
+  // and eof set once the peer has shut down its side
+  bool read_input(Connection &conn, bool &eof)
+  {
+    char buf[read_chunk_size];
+
+    for (;;)
+    {
+      ssize_t n = ::recv(conn.fd, buf, sizeof(buf), 0);
+
+      if (n > 0)
+      {
+        conn.last_active = std::chrono::steady_clock::now();
+
+        // streaming clients have nothing useful to say; waiting ones may
+        // pipeline their next request
+        if (!conn.channel || conn.waiting)
+          append_input(conn, buf, n);
+
+        continue;
+      }
+
+      if (n == 0)
+      {
+        eof = true;
+        return true;
+      }
+
+      if (errno == EINTR)
+        continue;
+
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+  }
+
+  // handled requests are only dropped here, when nothing refers to them
+  static void append_input(Connection &conn, const char *data, size_t size)
+  {
+    if (conn.in_offset > 0)
+    {
+      conn.in.erase(0, conn.in_offset);
+      conn.in_offset = 0;
+    }
+
+    conn.in.append(data, size);
+  }
+
+  // handles every complete request buffered on the connection
+  bool process_requests(Loop &loop, Connection &conn)
+  {
+    while (!conn.channel && !conn.close_after_write)
+    {
+      const char *begin = conn.in.data() + conn.in_offset;
+      size_t available = conn.in.size() - conn.in_offset;
+      auto parse_start = std::chrono::steady_clock::now();
+      size_t header_end = FlatRequest::find_head_end(begin, begin + available);
+
+      if (header_end == std::string::npos)
+      {
+        if (available > CPPHTTPLIB_REQUEST_URI_MAX_LENGTH + CPPHTTPLIB_HEADER_MAX_LENGTH)
+        {
+          queue_error(conn, httplib::StatusCode::RequestHeaderFieldsTooLarge_431);
+          return false;
+        }
+        return true;
+      }
+
+      FlatRequest flat;
+      httplib::Request req;
+
+      switch (flat.parse(begin, begin + header_end + 2))
+      {
+      case FlatRequest::Ok:
+        if (make_request(flat, req))
+          break;
+        // fall through
+      case FlatRequest::Invalid:
+        queue_error(conn, httplib::StatusCode::BadRequest_400);
+        return false;
+      case FlatRequest::TooManyHeaders:
+        queue_error(conn, httplib::StatusCode::RequestHeaderFieldsTooLarge_431);
+        return false;
+      }
+
+      loop.parse_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - parse_start).count();
+
+      // no route takes a body, but a small one is skipped if it was sent;
+      // a chunked one would need parsing to find its end
+      if (req.has_header("Transfer-Encoding"))
+      {
+        queue_error(conn, httplib::StatusCode::LengthRequired_411);
+        return false;
+      }
+
+      uint64_t body_length = req.get_header_value_u64("Content-Length");
+
+      if (body_length > max_body_size)
+      {
+        queue_error(conn, httplib::StatusCode::PayloadTooLarge_413);
+        return false;
+      }
+
+      size_t request_length = header_end + 4 + body_length;
+
+      if (available < request_length)
+        return true;
+
+      conn.in_offset += request_length;
+      conn.request_count++;
+      loop.requests++;
+
+      req.remote_addr = conn.remote_addr;
+      req.remote_port = conn.remote_port;
+      req.local_addr = conn.local_addr;
+      req.local_port = conn.local_port;
+
+      bool close = conn.request_count >= _keepAliveMaxCount ||
+                   header_equals(req, "Connection", "close") ||
+                   (req.version == "HTTP/1.0" && !header_equals(req, "Connection", "Keep-Alive"));
+
+      dispatch(loop, conn, req, close);
+
+      if (close && !conn.waiting)
+        conn.close_after_write = true;
+    }
+
+    return true;
+  }
+
+  static bool header_equals(const httplib::Request &req, const std::string &key, std::string_view value)
+  {
+    const httplib::HeaderView *view = req.find_header_view(key, 0);
+
+    return view && std::string_view(view->value, view->value_size) == value;
+  }
+
+  // only the request line is copied, into strings short enough for their
+  // inline storage for the usual paths; headers stay views into the buffer
+  static bool make_request(const FlatRequest &flat, httplib::Request &req)
+  {
+    if (flat.version != "HTTP/1.1" && flat.version != "HTTP/1.0")
+      return false;
+
+    req.method.assign(flat.method);
+    req.version.assign(flat.version);
+
+    std::string_view target = flat.target.substr(0, flat.target.find('#'));
+    size_t query = target.find('?');
+    std::string_view path = target.substr(0, query);
+
+    req.target.assign(target);
+
+    if (path.find('%') == std::string_view::npos)
+      req.path.assign(path);
+    else
+      req.path = httplib::detail::decode_url(std::string(path), false);
+
+    if (query != std::string_view::npos)
+      httplib::detail::parse_query_text(target.data() + query + 1, target.size() - query - 1, req.params);
+
+    req.header_views_ = flat.headers;
+    req.header_view_count_ = flat.header_count;
+    return true;
+  }
+
+  // the trie holds the plain and :param routes; one only a regex can match
+  // still wins if it was added first
+  const Route *find_route(httplib::Request &req) const
+  {
+    httplib::detail::RouteTrie::Captures captures;
+    size_t index = _routeIndex.find(req.path, captures);
+
+    for (size_t i : _routeIndex.unindexed())
+    {
+      if (i > index)
+        break;
+
+      if (_routes[i].matcher->match(req))
+        return &_routes[i];
+    }
+
+    if (index == httplib::detail::RouteTrie::npos)
+      return nullptr;
+
+    _routeIndex.set_path_params(index, captures, req);
+    return &_routes[index];
+  }
+
+  void dispatch(Loop &loop, Connection &conn, httplib::Request &req, bool close)
+  {
+    httplib::Response res;
+    const Route *route = nullptr;
+
+    if (req.method == "GET" || req.method == "HEAD")
+      route = find_route(req);
+
+    if (!route)
+    {
+      res.status = req.method == "GET" || req.method == "HEAD"
+        ? httplib::StatusCode::NotFound_404
+        : httplib::StatusCode::MethodNotAllowed_405;
+      queue_response(conn, req, res, close);
+      return;
+    }
+
+    // taken before the handler looks, so a message published meanwhile
+    // still ends the wait
+    uint64_t sequence = route->channel ? channel_sequence(*route->channel) : 0;
+    bool wait = false;
+
+    try {
+      if (route->wait_handler)
+        wait = route->wait_handler(req, res);
+      else
+        route->handler(req, res);
+    }
+    catch(std::exception &e) {
+      LogError("event server handler for %s failed: %s", req.path.c_str(), e.what());
+      res = httplib::Response();
+      res.status = httplib::StatusCode::InternalServerError_500;
+      wait = false;
+    }
+
+    if (res.status == -1)
+      res.status = httplib::StatusCode::OK_200;
+
+    if (route->wait_handler)
+    {
+      if (wait && req.method == "GET")
+        start_wait(loop, conn, req, res, close, route->channel, sequence);
+      else
+        queue_response(conn, req, res, close);
+      return;
+    }
+
+    if (route->channel && res.status == httplib::StatusCode::OK_200 && req.method == "GET")
+    {
+      // one published since the handler looked is still sent
+      if (route->resume_handler && route->resume_handler(req))
+        conn.channel_sequence = sequence;
+
+      start_stream(loop, conn, req, res, route->channel);
+      return;
+    }
+
+    queue_response(conn, req, res, close);
+  }
+
+  static uint64_t channel_sequence(Channel &channel)
+  {
+    std::lock_guard<std::mutex> lock(channel.mutex);
+    return channel.sequence;
+  }
+
+  static std::string serialize_head(httplib::Response &res)
+  {
+    httplib::detail::BufferStream bstrm;
+
+    httplib::detail::write_response_line(bstrm, res.status);
+    httplib::detail::write_headers(bstrm, res.headers);
+
+    return bstrm.get_buffer();
+  }
+
+  static void queue_string(std::deque<Buffer> &out, std::string &&data)
+  {
+    auto owner = std::make_shared<std::string>(std::move(data));
+
+    out.push_back(Buffer{owner, owner->data(), owner->size()});
+  }
+
+  static void queue_string(Connection &conn, std::string &&data)
+  {
+    queue_string(conn.out, std::move(data));
+  }
+
+  std::string connection_header(bool close) const
+  {
+    if (close)
+      return "Connection: close\r\n";
+
+    return "Keep-Alive: timeout=" + std::to_string(_keepAliveTimeoutSec) +
+           ", max=" + std::to_string(_keepAliveMaxCount) + "\r\n";
+  }
+
+  // sets the framing headers; a body from a content provider is copied in,
+  // since the provider's data is only valid while it runs
+  void finish_response(const httplib::Request &req, httplib::Response &res, bool close)
+  {
+    if (res.body.empty() && res.content_provider_ && !res.is_chunked_content_provider_)
+    {
+      httplib::DataSink sink;
+
+      sink.write = [&res](const char *data, size_t size) {
+        res.body.append(data, size);
+        return true;
+      };
+      sink.is_writable = [] { return true; };
+
+      res.body.reserve(res.content_length_);
+
+      if (req.method != "HEAD" && !res.content_provider_(0, res.content_length_, sink))
+        res.body.clear();
+
+      if (!res.has_header("Content-Length"))
+        res.set_header("Content-Length", std::to_string(res.content_length_));
+    }
+
+    if (close)
+    {
+      res.set_header("Connection", "close");
+    }
+    else
+    {
+      res.set_header("Keep-Alive", "timeout=" + std::to_string(_keepAliveTimeoutSec) +
+                                   ", max=" + std::to_string(_keepAliveMaxCount));
+    }
+
+    if (!res.body.empty() && !res.has_header("Content-Type"))
+      res.set_header("Content-Type", "text/plain");
+
+    if (!res.has_header("Content-Length"))
+      res.set_header("Content-Length", std::to_string(res.body.size()));
+  }
+
+  // a pre-serialized response goes out as its own head and body buffers,
+  // with only the connection header line built here
+  void serialize_response(const httplib::Request &req, httplib::Response &res, bool close, std::deque<Buffer> &out)
+  {
+    if (res.serialized_head_)
+    {
+      out.push_back(Buffer{res.serialized_owner_, res.serialized_head_, res.serialized_head_length_});
+      queue_string(out, connection_header(close) + "\r\n");
+
+      if (req.method != "HEAD" && res.serialized_body_length_ > 0)
+        out.push_back(Buffer{res.serialized_owner_, res.serialized_body_, res.serialized_body_length_});
+
+      return;
+    }
+
+    finish_response(req, res, close);
+    queue_string(out, serialize_head(res));
+
+    if (req.method != "HEAD" && !res.body.empty())
+      queue_string(out, std::move(res.body));
+  }
+
+  void queue_response(Connection &conn, const httplib::Request &req, httplib::Response &res, bool close)
+  {
+    serialize_response(req, res, close, conn.out);
+  }
+
+  void queue_error(Connection &conn, int status)
+  {
+    httplib::Request req;
+    httplib::Response res;
+
+    res.status = status;
+    queue_response(conn, req, res, true);
+  }
+
+  void start_stream(Loop &loop, Connection &conn, const httplib::Request &req, httplib::Response &res, Channel_h channel)
+  {
+    res.set_header("Connection", "close");
+    queue_string(conn, serialize_head(res));
+
+    if (!res.body.empty())
+      queue_string(conn, std::move(res.body));
+
+    conn.channel = channel;
+    conn.in.clear();
+    conn.in_offset = 0;
+    loop.streams.insert(&conn);
+    loop.stream_count++;
+
+    LogDeb("event stream client %s:%d connected on loop %d", conn.remote_addr.c_str(), conn.remote_port, loop.index);
+
+    offer_latest(loop, conn);
+  }
+
+  // parks the connection; the timeout answer is serialized up front
+  void start_wait(Loop &loop, Connection &conn, const httplib::Request &req, httplib::Response &res,
+                  bool close, Channel_h channel, uint64_t sequence)
+  {
+    serialize_response(req, res, close, conn.wait_timeout);
+    conn.close_after_wait = close;
+    conn.wait_started = std::chrono::steady_clock::now();
+    conn.waiting = true;
+    conn.channel = channel;
+    conn.channel_sequence = sequence;
+    loop.streams.insert(&conn);
+    loop.waiting_count++;
+
+    offer_latest(loop, conn);
+
+    if (conn.pending)
+      end_wait(loop, conn, false);
+  }
+
+  // answers a parked connection with the pending message, or with its
+  // timeout answer, then carries on with any request it sent meanwhile
+  void end_wait(Loop &loop, Connection &conn, bool timed_out)
+  {
+    if (timed_out)
+    {
+      for (auto &buffer : conn.wait_timeout)
+        conn.out.push_back(buffer);
+    }
+    else
+    {
+      for (auto &buffer : *conn.pending)
+        conn.out.push_back(buffer);
+
+      conn.sent++;
+    }
+
+    conn.pending.reset();
+    conn.waiting = false;
+    conn.channel.reset();
+    conn.wait_timeout.clear();
+    loop.streams.erase(&conn);
+    loop.waiting_count--;
+
+    if (conn.close_after_wait)
+      conn.close_after_write = true;
+    else if (!process_requests(loop, conn))
+      conn.close_after_write = true;
+  }
+
+  void deliver_messages(Loop &loop)
+  {
+    std::vector<int> failed;
+
+    // ending a wait changes the set, and may park the connection again
+    std::vector<Connection *> streams(loop.streams.begin(), loop.streams.end());
+
+    for (Connection *conn : streams)
+    {
+      offer_latest(loop, *conn);
+
+      if (conn->waiting && conn->pending)
+        end_wait(loop, *conn, false);
+
+      if (!flush(loop, *conn))
+        failed.push_back(conn->fd);
+    }
+
+    for (int fd : failed)
+      close_connection(loop, fd);
+  }
+
+  // latest message wins: a connection still writing keeps just one pending
+  void offer_latest(Loop &loop, Connection &conn)
+  {
+    Message_h message;
+    uint64_t sequence;
+
+    {
+      std::lock_guard<std::mutex> lock(conn.channel->mutex);
+      message = conn.channel->latest;
+      sequence = conn.channel->sequence;
+    }
+
+    if (!message || sequence == conn.channel_sequence)
+      return;
+
+    conn.channel_sequence = sequence;
+
+    if (conn.pending)
+    {
+      conn.dropped++;
+      loop.dropped++;
+    }
+
+    conn.pending = message;
+  }
+
+  // writes as much queued data as the socket takes; false on a dead socket
+  bool flush(Loop &loop, Connection &conn)
+  {
+    for (;;)
+    {
+      if (conn.out.empty() && conn.pending)
+      {
+        for (auto &buffer : *conn.pending)
+          conn.out.push_back(buffer);
+
+        conn.pending.reset();
+        conn.sent++;
+      }
+
+      if (conn.out.empty())
+        return !conn.close_after_write;
+
+      struct iovec iov[max_iov];
+      int iovcnt = 0;
+
+      for (auto it = conn.out.begin(); it != conn.out.end() && iovcnt < max_iov; ++it, ++iovcnt)
+      {
+        size_t skip = iovcnt == 0 ? conn.out_offset : 0;
+
+        iov[iovcnt].iov_base = const_cast<char *>(it->data + skip);
+        iov[iovcnt].iov_len = it->size - skip;
+      }
+
+      struct msghdr msg = {0};
+
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+
+      ssize_t n = ::sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+
+        // EPOLLOUT will call us again once there is room
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+
+      conn.last_active = std::chrono::steady_clock::now();
+
+      size_t written = n;
+
+      while (written > 0)
+      {
+        size_t remaining = conn.out.front().size - conn.out_offset;
+
+        if (written < remaining)
+        {
+          conn.out_offset += written;
+          break;
+        }
+
+        written -= remaining;
+        conn.out.pop_front();
+        conn.out_offset = 0;
+      }
+    }
+  }
+
+  void sweep_idle(Loop &loop, std::chrono::steady_clock::time_point now)
+  {
+    std::vector<int> expired;
+    std::vector<Connection *> waited_out;
+
+    for (auto &entry : loop.connections)
+    {
+      Connection &conn = *entry.second;
+      auto idle = now - conn.last_active;
+
+      if (conn.waiting)
+      {
+        if (now - conn.wait_started > std::chrono::seconds(_waitTimeoutSec))
+          waited_out.push_back(&conn);
+      }
+      else if (conn.out.empty())
+      {
+        if (!conn.channel && idle > std::chrono::seconds(_keepAliveTimeoutSec))
+          expired.push_back(entry.first);
+      }
+      else if (idle > std::chrono::seconds(_writeTimeoutSec))
+      {
+        // a client that has not taken any data for the write timeout
+        expired.push_back(entry.first);
+      }
+    }
+
+    for (Connection *conn : waited_out)
+    {
+      end_wait(loop, *conn, true);
+
+      if (!flush(loop, *conn))
+        expired.push_back(conn->fd);
+    }
+
+    for (int fd : expired)
+      close_connection(loop, fd);
+  }
+};
+
+#endif
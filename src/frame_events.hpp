@@ -0,0 +1,231 @@
+#ifndef _FRAME_EVENTS_HPP
+#define _FRAME_EVENTS_HPP
+
+#include "httpd.hpp"
+#include "camera.hpp"
+#include "rjpg-capture.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// Announces every new frame as a Server-Sent Event on /events, so clients
+// that only need to know a frame exists can wait for one and then fetch
+// it (or not) from /capture-image, instead of polling for images.
+//
+// An event carries the frame's sequence, capture time, JPEG size, the
+// camera epoch and the ETag /capture-image will give it; its id is the
+// ETag without the quotes, so a reconnecting client's Last-Event-ID
+// resumes after the frame it last saw. A watcher thread formats each
+// event once and every connection writes the same text; a client that is
+// slower than the camera simply gets the newest event when it is ready.
+// A comment line keeps idle connections from timing out.
+//
+// serve() does all of this for the thread per connection servers, the
+// default one and -A. On the event servers (-E, -U) the connections are
+// fed through the sink instead: retry_preamble goes out ahead of the
+// events, resuming skips the latest event if the client has it, and the
+// watcher passes keepalives on when the camera has been quiet.
+struct FrameEvents
+{
+  static constexpr std::chrono::seconds keepalive{15};
+
+  // clients reconnect a second after losing the connection
+  static constexpr const char *retry_preamble = "retry: 1000\n\n";
+
+  struct Event
+  {
+    uint64_t sequence;
+    std::string text;
+  };
+  typedef std::shared_ptr<const Event> Event_h;
+
+  Camera &_camera;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  Event_h _latest;
+  std::atomic<bool> _running{true};
+  std::thread _watcherThread;
+
+  // also receives every event, e.g. to feed another server's connections
+  std::mutex _sinkMutex;
+  std::function<void(const Event_h &)> _eventSink;
+
+  std::atomic<int> _clients{0};
+  std::atomic<uint64_t> _events{0};
+  std::atomic<uint64_t> _sent{0};
+
+  FrameEvents(Camera &camera) : _camera(camera)
+  {
+    _watcherThread = std::thread([this] {
+      watcher_loop();
+    });
+  }
+
+  ~FrameEvents()
+  {
+    _running = false;
+
+    if (_watcherThread.joinable())
+      _watcherThread.join();
+  }
+
+  static Event_h make_event(const Camera::Frame &frame)
+  {
+    auto event = std::make_shared<Event>();
+    long long timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      frame.timestamp.time_since_epoch()).count();
+
+    event->sequence = frame.sequence;
+    event->text = string_format("id: %llx-%llu\n"
+                                "event: frame\n"
+                                "data: {\"sequence\":%llu,\"timestamp_us\":%lld,\"size\":%zu,"
+                                "\"camera\":\"%llx\",\"etag\":\"\\\"%llx-%llu\\\"\"}\n"
+                                "\n",
+                                (unsigned long long)frame.epoch, (unsigned long long)frame.sequence,
+                                (unsigned long long)frame.sequence, timestamp_us, frame.data->size(),
+                                (unsigned long long)frame.epoch,
+                                (unsigned long long)frame.epoch, (unsigned long long)frame.sequence);
+    return event;
+  }
+
+  void set_event_sink(std::function<void(const Event_h &)> sink)
+  {
+    std::lock_guard<std::mutex> lock(_sinkMutex);
+    _eventSink = sink;
+  }
+
+  void watcher_loop()
+  {
+    uint64_t last_sequence = 0;
+    auto last_sent = std::chrono::steady_clock::now();
+    const Event_h keepalive_event = std::make_shared<const Event>(Event{0, ": keepalive\n\n"});
+
+    while (_running)
+    {
+      Camera::Frame_h frame = _camera.wait_for_frame(last_sequence, std::chrono::seconds(1));
+
+      std::function<void(const Event_h &)> sink;
+      {
+        std::lock_guard<std::mutex> lock(_sinkMutex);
+        sink = _eventSink;
+      }
+
+      if (!frame)
+      {
+        if (sink && std::chrono::steady_clock::now() - last_sent >= keepalive)
+        {
+          sink(keepalive_event);
+          last_sent = std::chrono::steady_clock::now();
+        }
+        continue;
+      }
+
+      last_sequence = frame->sequence;
+
+      if (!frame->data)
+        continue;
+
+      // formatted even with nobody listening, so a new client's first
+      // event is never about a stale frame
+      Event_h event = make_event(*frame);
+      last_sent = std::chrono::steady_clock::now();
+
+      _events++;
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _latest = event;
+      }
+      _cond.notify_all();
+
+      if (sink)
+        sink(event);
+    }
+  }
+
+  Event_h wait_newer(uint64_t after_sequence, std::chrono::seconds timeout)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _cond.wait_for(lock, timeout, [&] { return _latest && _latest->sequence > after_sequence; });
+    return _latest;
+  }
+
+  // the sequence of the frame a reconnecting client last saw, if it was
+  // from this camera run
+  uint64_t resume_after(const httplib::Request &req)
+  {
+    unsigned long long epoch = 0, sequence = 0;
+    Camera::Frame_h frame = _camera.latest_frame();
+
+    if (!frame || !req.has_header("Last-Event-ID") ||
+        sscanf(req.get_header_value("Last-Event-ID").c_str(), "%llx-%llu", &epoch, &sequence) != 2 ||
+        epoch != frame->epoch)
+      return 0;
+
+    return sequence;
+  }
+
+  // whether a reconnecting client already saw the latest event
+  bool has_latest(const httplib::Request &req)
+  {
+    uint64_t after = resume_after(req);
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return after != 0 && _latest && after >= _latest->sequence;
+  }
+
+  static void set_headers(httplib::Response &res)
+  {
+    res.set_header("Cache-Control", "no-cache");
+    res.set_header("X-Accel-Buffering", "no"); // nor should a proxy hold events back
+  }
+
+  void serve(const httplib::Request &req, httplib::Response &res)
+  {
+    auto last_sequence = std::make_shared<uint64_t>(resume_after(req));
+
+    _clients++;
+    set_headers(res);
+
+    res.set_chunked_content_provider(
+      "text/event-stream",
+      [this, last_sequence](size_t offset, httplib::DataSink &sink) {
+        if (offset == 0 && !sink.write(retry_preamble, strlen(retry_preamble)))
+          return false;
+
+        Event_h event = wait_newer(*last_sequence, keepalive);
+
+        if (!event || event->sequence <= *last_sequence)
+          return sink.write(": keepalive\n\n", 13);
+
+        *last_sequence = event->sequence;
+        _sent++;
+        return sink.write(event->text.data(), event->text.size());
+      },
+      [this](bool success) {
+        _clients--;
+      });
+  }
+
+  std::string stats()
+  {
+    std::ostringstream out;
+
+    out << "rjpg_events_clients " << _clients << "\n";
+    out << "rjpg_events_published_total " << _events << "\n";
+    out << "rjpg_events_sent_total " << _sent << "\n";
+
+    return out.str();
+  }
+};
+
+#endif
@@ -235,14 +235,13 @@ using socket_t = SOCKET;
 #include <resolv.h>
 #endif
 #include <netinet/tcp.h>
-#ifdef CPPHTTPLIB_USE_POLL
 #include <poll.h>
-#endif
 #include <csignal>
 #include <pthread.h>
 #include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -276,6 +275,7 @@ using socket_t = int;
 #include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <sys/stat.h>
 #include <thread>
 #include <unordered_map>
@@ -560,6 +560,9 @@ public:
   std::function<bool()> is_writable;
   std::function<void()> done;
   std::function<void(const Headers &trailer)> done_with_trailer;
+  // Underlying plain socket, only set for unframed, unencrypted responses
+  // where the provider may tune or write to the socket directly.
+  std::function<socket_t()> socket;
   std::ostream os;
 
 private:
@@ -632,6 +635,21 @@ public:
 using Range = std::pair<ssize_t, ssize_t>;
 using Ranges = std::vector<Range>;
 
+namespace detail {
+class RequestArena;
+inline void emplace_header(Headers &headers, std::string_view key,
+                           std::string_view val);
+} // namespace detail
+
+// A header field parsed in place by a server that keeps the request bytes
+// alive while the handler runs; see Request::header_views_.
+struct HeaderView {
+  const char *name = nullptr;
+  size_t name_size = 0;
+  const char *value = nullptr;
+  size_t value_size = 0;
+};
+
 struct Request {
   std::string method;
   std::string path;
@@ -651,6 +669,7 @@ struct Request {
   Ranges ranges;
   Match matches;
   std::unordered_map<std::string, std::string> path_params;
+  std::function<bool()> is_connection_closed = []() { return false; };
 
   // for client
   ResponseHandler response_handler;
@@ -684,6 +703,13 @@ struct Request {
   ContentProvider content_provider_;
   bool is_chunked_content_provider_ = false;
   size_t authorization_count_ = 0;
+
+  // Header fields left in the server's buffer instead of copied into
+  // headers; the header lookups use them when headers is empty.
+  const HeaderView *header_views_ = nullptr;
+  size_t header_view_count_ = 0;
+
+  const HeaderView *find_header_view(const std::string &key, size_t id) const;
 };
 
 struct Response {
@@ -723,6 +749,15 @@ struct Response {
                         const std::string &content_type);
   void set_file_content(const std::string &path);
 
+  // Status line and headers serialized ahead of time, ending with the CRLF
+  // of the last header line, and the body they describe. Unless the request
+  // asks for ranges, the server appends its connection headers and sends it
+  // all in one gathered write; the content set on the response must be the
+  // same body, it is what the regular path sends. owner keeps both alive.
+  void set_serialized_head(std::shared_ptr<const void> owner, const char *head,
+                           size_t head_length, const char *body,
+                           size_t body_length);
+
   Response() = default;
   Response(const Response &) = default;
   Response &operator=(const Response &) = default;
@@ -742,8 +777,117 @@ struct Response {
   bool content_provider_success_ = false;
   std::string file_content_path_;
   std::string file_content_content_type_;
+  std::shared_ptr<const void> serialized_owner_;
+  const char *serialized_head_ = nullptr;
+  size_t serialized_head_length_ = 0;
+  const char *serialized_body_ = nullptr;
+  size_t serialized_body_length_ = 0;
+};
+
+namespace detail {
+
+// One connection's Request and Response, kept for all of its keep-alive
+// requests. Between requests they are reset to defaults, but the strings
+// keep their storage, and the nodes of their header maps, with the strings
+// in them, are kept for the headers of the next request. While an arena is
+// in scope, header inserts on its thread take recycled nodes first.
+class RequestArena {
+public:
+  RequestArena() : outer_(current()) { current() = this; }
+  ~RequestArena() { current() = outer_; }
+
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  static RequestArena *&current() {
+    static thread_local RequestArena *arena = nullptr;
+    return arena;
+  }
+
+  Request &request() { return req_; }
+  Response &response() { return res_; }
+
+  // storage for serializing the response head, kept between requests
+  std::string &head_buffer() { return head_buffer_; }
+
+  void emplace_header(Headers &headers, std::string_view key,
+                      std::string_view val) {
+    if (header_nodes_.empty()) {
+      headers.emplace(key, val);
+      return;
+    }
+
+    auto node = std::move(header_nodes_.back());
+    header_nodes_.pop_back();
+    node.key().assign(key);
+    node.mapped().assign(val);
+    headers.insert(std::move(node));
+  }
+
+  // ends the request: runs the response's resource releaser, as its
+  // destructor would, and makes both objects ready for the next one
+  void reset() {
+    if (res_.content_provider_resource_releaser_) {
+      res_.content_provider_resource_releaser_(res_.content_provider_success_);
+    }
+
+    recycle(req_.headers);
+    recycle(res_.headers);
+
+    Request req;
+    keep(req.method, req_.method);
+    keep(req.path, req_.path);
+    keep(req.body, req_.body);
+    keep(req.remote_addr, req_.remote_addr);
+    keep(req.local_addr, req_.local_addr);
+    keep(req.version, req_.version);
+    keep(req.target, req_.target);
+    req.headers.swap(req_.headers);
+    req_.ranges.clear();
+    req.ranges.swap(req_.ranges);
+    req_ = std::move(req);
+
+    Response res;
+    keep(res.version, res_.version);
+    keep(res.reason, res_.reason);
+    keep(res.body, res_.body);
+    keep(res.location, res_.location);
+    res.headers.swap(res_.headers);
+    res_.content_provider_resource_releaser_ = nullptr;
+    res_ = std::move(res);
+  }
+
+private:
+  // the emptied map keeps its buckets
+  void recycle(Headers &headers) {
+    while (!headers.empty()) {
+      header_nodes_.push_back(headers.extract(headers.begin()));
+    }
+  }
+
+  static void keep(std::string &fresh, std::string &used) {
+    used.clear();
+    fresh.swap(used);
+  }
+
+  RequestArena *outer_;
+  Request req_;
+  Response res_;
+  std::string head_buffer_;
+  std::vector<Headers::node_type> header_nodes_;
 };
 
+inline void emplace_header(Headers &headers, std::string_view key,
+                           std::string_view val) {
+  if (auto arena = RequestArena::current()) {
+    arena->emplace_header(headers, key, val);
+  } else {
+    headers.emplace(key, val);
+  }
+}
+
+} // namespace detail
+
 class Stream {
 public:
   virtual ~Stream() = default;
@@ -770,6 +914,13 @@ public:
   virtual void shutdown() = 0;
 
   virtual void on_idle() {}
+
+  // Called for the task serving a newly accepted connection, so a queue
+  // can pick where to run it from the socket, e.g. by peeking at the
+  // request line.
+  virtual bool enqueue_connection(socket_t /*sock*/, std::function<void()> fn) {
+    return enqueue(std::move(fn));
+  }
 };
 
 class ThreadPool final : public TaskQueue {
@@ -933,6 +1084,56 @@ private:
   std::regex regex_;
 };
 
+/**
+ * Finds the route for a request path by walking its segments, instead of
+ * trying every route's matcher in turn.
+ *
+ * Holds the routes a PathParamsMatcher or a RegexMatcher without any regex
+ * syntax would match: static segments are looked up by name, ":name"
+ * segments capture whatever segment is there. Among the routes matching a
+ * path, the one added with the lowest index wins, as with the matchers in
+ * registration order. Routes the trie cannot hold are listed by unindexed()
+ * for the caller to match the usual way.
+ *
+ * Unlike a RegexMatcher, a route found here leaves Request::matches empty;
+ * a handler for a plain path no longer finds the path in matches[0].
+ */
+class RouteTrie {
+public:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+  static constexpr size_t max_params = 8;
+
+  struct Captures {
+    std::string_view values[max_params];
+  };
+
+  // false if the pattern needs its matcher; it is then listed as unindexed
+  bool add(const std::string &pattern, size_t index);
+
+  // index of the first route matching path, or npos
+  size_t find(const std::string &path, Captures &captures) const;
+
+  void set_path_params(size_t index, const Captures &captures,
+                       Request &req) const;
+
+  // indexes of the routes that were not added, ascending
+  const std::vector<size_t> &unindexed() const { return unindexed_; }
+
+private:
+  struct Node {
+    std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+    std::unique_ptr<Node> param;
+    size_t index = npos;
+  };
+
+  void match(const Node &node, std::string_view rest, Captures &values,
+             size_t count, size_t &best, Captures &best_values) const;
+
+  Node root_;
+  std::vector<std::vector<std::string>> param_names_;
+  std::vector<size_t> unindexed_;
+};
+
 ssize_t write_headers(Stream &strm, const Headers &headers);
 
 } // namespace detail
@@ -1024,6 +1225,11 @@ public:
 
   Server &set_payload_max_length(size_t length);
 
+  // Serve requests from clients that shut down their sending side after
+  // the request instead of dropping them as abandoned. A client that
+  // closed is then only noticed when the response is written.
+  Server &set_serve_half_closed(bool on);
+
   bool bind_to_port(const std::string &host, int port, int socket_flags = 0);
   int bind_to_any_port(const std::string &host, int socket_flags = 0);
   bool listen_after_bind();
@@ -1037,12 +1243,16 @@ public:
 
   std::function<TaskQueue *(void)> new_task_queue;
 
+  // requests dropped because the client had disconnected before a handler ran
+  uint64_t abandoned_requests() const { return abandoned_requests_; }
+
 protected:
   bool process_request(Stream &strm, const std::string &remote_addr,
                        int remote_port, const std::string &local_addr,
                        int local_port, bool close_connection,
                        bool &connection_closed,
-                       const std::function<void(Request &)> &setup_request);
+                       const std::function<void(Request &)> &setup_request,
+                       detail::RequestArena &arena);
 
   std::atomic<socket_t> svr_sock_{INVALID_SOCKET};
   size_t keep_alive_max_count_ = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
@@ -1054,16 +1264,22 @@ protected:
   time_t idle_interval_sec_ = CPPHTTPLIB_IDLE_INTERVAL_SECOND;
   time_t idle_interval_usec_ = CPPHTTPLIB_IDLE_INTERVAL_USECOND;
   size_t payload_max_length_ = CPPHTTPLIB_PAYLOAD_MAX_LENGTH;
+  bool serve_half_closed_ = false;
 
 private:
-  using Handlers =
-      std::vector<std::pair<std::unique_ptr<detail::MatcherBase>, Handler>>;
+  struct Handlers {
+    std::vector<std::pair<std::unique_ptr<detail::MatcherBase>, Handler>>
+        list;
+    detail::RouteTrie routes; // by index into list
+  };
   using HandlersForContentReader =
       std::vector<std::pair<std::unique_ptr<detail::MatcherBase>,
                             HandlerWithContentReader>>;
 
   static std::unique_ptr<detail::MatcherBase>
   make_matcher(const std::string &pattern);
+  static void add_handler(Handlers &handlers, const std::string &pattern,
+                          Handler handler);
 
   Server &set_error_handler_core(HandlerWithResponse handler, std::true_type);
   Server &set_error_handler_core(Handler handler, std::false_type);
@@ -1093,6 +1309,8 @@ private:
   bool write_response_core(Stream &strm, bool close_connection,
                            const Request &req, Response &res,
                            bool need_apply_ranges);
+  bool write_serialized_response(Stream &strm, bool close_connection,
+                                 const Request &req, Response &res);
   bool write_content_with_provider(Stream &strm, const Request &req,
                                    Response &res, const std::string &boundary,
                                    const std::string &content_type);
@@ -1111,6 +1329,13 @@ private:
 
   std::atomic<bool> is_running_{false};
   std::atomic<bool> is_decommisioned{false};
+  std::atomic<uint64_t> abandoned_requests_{0};
+
+  // the Keep-Alive header value for the settings above, formatted when they
+  // change rather than for every response
+  static std::string keep_alive_value(time_t timeout_sec, size_t max_count);
+  std::string keep_alive_value_ =
+      keep_alive_value(keep_alive_timeout_sec_, keep_alive_max_count_);
 
   struct MountPointEntry {
     std::string mount_point;
@@ -2051,6 +2276,11 @@ inline uint64_t get_header_value_u64(const Headers &headers,
 
 inline uint64_t Request::get_header_value_u64(const std::string &key,
                                               uint64_t def, size_t id) const {
+  if (headers.empty() && header_view_count_) {
+    // the value is followed by the line's CRLF, which ends the number
+    auto view = find_header_view(key, id);
+    return view ? std::strtoull(view->value, nullptr, 10) : def;
+  }
   return detail::get_header_value_u64(headers, key, def, id);
 }
 
@@ -2392,6 +2622,9 @@ public:
 
   const std::string &get_buffer() const;
 
+  // exchanges the buffer for other, emptied, so its storage can be reused
+  void swap_buffer(std::string &other);
+
 private:
   std::string buffer;
   size_t position = 0;
@@ -3125,6 +3358,35 @@ inline ssize_t send_socket(socket_t sock, const void *ptr, size_t size,
   });
 }
 
+#ifndef _WIN32
+// Gather-write every buffer, retrying on partial writes. Returns false on
+// error or if the peer went away.
+inline bool send_socket_vectored(socket_t sock, struct iovec *iov, int iovcnt,
+                                 int flags) {
+  while (iovcnt > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = static_cast<size_t>(iovcnt);
+
+    auto n = handle_EINTR([&]() { return sendmsg(sock, &msg, flags); });
+    if (n <= 0) { return false; }
+
+    auto sent = static_cast<size_t>(n);
+    while (iovcnt > 0 && sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return true;
+}
+#endif
+
 inline ssize_t select_read(socket_t sock, time_t sec, time_t usec) {
 #ifdef CPPHTTPLIB_USE_POLL
   struct pollfd pfd_read;
@@ -3249,6 +3511,36 @@ inline bool is_socket_alive(socket_t sock) {
   return detail::read_socket(sock, &buf[0], sizeof(buf), MSG_PEEK) > 0;
 }
 
+// True once the peer has reset the connection or it is shut down both
+// ways, and, with fin_is_closed, also once the peer has sent a FIN and
+// everything it sent before has been read. A client that closed and one
+// that only shut down its sending side after the request both just send
+// a FIN, and cannot be told apart until something is written to them.
+inline bool is_peer_closed(socket_t sock, bool fin_is_closed) {
+#ifdef _WIN32
+  if (select_read(sock, 0, 0) <= 0) { return false; }
+  char buf[1];
+  auto n = read_socket(sock, &buf[0], sizeof(buf), MSG_PEEK);
+  return n < 0 || (n == 0 && fin_is_closed);
+#else
+  struct pollfd pfd;
+  pfd.fd = sock;
+  pfd.events = fin_is_closed ? POLLRDHUP : 0;
+  pfd.revents = 0;
+
+  if (handle_EINTR([&]() { return poll(&pfd, 1, 0); }) <= 0) { return false; }
+
+  if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) { return true; }
+  if (!(pfd.revents & POLLRDHUP)) { return false; }
+
+  // nothing unread is left before the FIN
+  char buf[1];
+  return handle_EINTR([&]() {
+           return recv(sock, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+         }) == 0;
+#endif
+}
+
 class SocketStream final : public Stream {
 public:
   SocketStream(socket_t sock, time_t read_timeout_sec, time_t read_timeout_usec,
@@ -3270,11 +3562,13 @@ private:
   time_t write_timeout_sec_;
   time_t write_timeout_usec_;
 
-  std::vector<char> read_buff_;
+  // a new stream is made for every keep-alive request, so the buffer is
+  // kept in the stream rather than allocated
+  static const size_t read_buff_size_ = 1024l * 4;
+
+  std::array<char, read_buff_size_> read_buff_;
   size_t read_buff_off_ = 0;
   size_t read_buff_content_size_ = 0;
-
-  static const size_t read_buff_size_ = 1024l * 4;
 };
 
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
@@ -4139,8 +4433,10 @@ inline const char *get_header_value(const Headers &headers,
   return def;
 }
 
+// Calls fn with views of the key and the value, which only needs a string
+// of its own when it has escapes to decode.
 template <typename T>
-inline bool parse_header(const char *beg, const char *end, T fn) {
+inline bool parse_header_view(const char *beg, const char *end, T fn) {
   // Skip trailing spaces and tabs.
   while (beg < end && is_space_or_tab(end[-1])) {
     end--;
@@ -4165,10 +4461,15 @@ inline bool parse_header(const char *beg, const char *end, T fn) {
     auto key_len = key_end - beg;
     if (!key_len) { return false; }
 
-    auto key = std::string(beg, key_end);
-    auto val = case_ignore::equal(key, "Location")
-                   ? std::string(p, end)
-                   : decode_url(std::string(p, end), false);
+    auto key = std::string_view(beg, static_cast<size_t>(key_len));
+    auto val = std::string_view(p, static_cast<size_t>(end - p));
+
+    std::string decoded;
+    if (val.find('%') != std::string_view::npos &&
+        !case_ignore::equal(std::string(key), "Location")) {
+      decoded = decode_url(std::string(val), false);
+      val = decoded;
+    }
 
     // NOTE: From RFC 9110:
     // Field values containing CR, LF, or NUL characters are
@@ -4178,8 +4479,10 @@ inline bool parse_header(const char *beg, const char *end, T fn) {
     // value MUST either reject the message or replace each of
     // those characters with SP before further processing or
     // forwarding of that message.
-    static const std::string CR_LF_NUL("\r\n\0", 3);
-    if (val.find_first_of(CR_LF_NUL) != std::string::npos) { return false; }
+    static constexpr std::string_view CR_LF_NUL("\r\n\0", 3);
+    if (val.find_first_of(CR_LF_NUL) != std::string_view::npos) {
+      return false;
+    }
 
     fn(key, val);
     return true;
@@ -4188,6 +4491,16 @@ inline bool parse_header(const char *beg, const char *end, T fn) {
   return false;
 }
 
+template <typename T>
+inline bool parse_header(const char *beg, const char *end, T fn) {
+  return parse_header_view(
+      beg, end, [&](std::string_view key_view, std::string_view val_view) {
+        auto key = std::string(key_view);
+        auto val = std::string(val_view);
+        fn(key, val);
+      });
+}
+
 inline bool read_headers(Stream &strm, Headers &headers) {
   const auto bufsiz = 2048;
   char buf[bufsiz];
@@ -4216,10 +4529,10 @@ inline bool read_headers(Stream &strm, Headers &headers) {
     // Exclude line terminator
     auto end = line_reader.ptr() + line_reader.size() - line_terminator_len;
 
-    if (!parse_header(line_reader.ptr(), end,
-                      [&](const std::string &key, std::string &val) {
-                        headers.emplace(key, val);
-                      })) {
+    if (!parse_header_view(line_reader.ptr(), end,
+                           [&](std::string_view key, std::string_view val) {
+                             emplace_header(headers, key, val);
+                           })) {
       return false;
     }
   }
@@ -4437,26 +4750,24 @@ inline ssize_t write_request_line(Stream &strm, const std::string &method,
 }
 
 inline ssize_t write_response_line(Stream &strm, int status) {
-  std::string s = "HTTP/1.1 ";
-  s += std::to_string(status);
-  s += " ";
-  s += httplib::status_message(status);
-  s += "\r\n";
-  return strm.write(s.data(), s.size());
+  char line[128];
+  auto len = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status,
+                      httplib::status_message(status));
+  if (len < 0) { return len; }
+  return strm.write(line, std::min(static_cast<size_t>(len), sizeof(line) - 1));
 }
 
+// the parts of each line are written separately; the stream is a buffer
+// wherever the server and the client write headers
 inline ssize_t write_headers(Stream &strm, const Headers &headers) {
   ssize_t write_len = 0;
   for (const auto &x : headers) {
-    std::string s;
-    s = x.first;
-    s += ": ";
-    s += x.second;
-    s += "\r\n";
-
-    auto len = strm.write(s.data(), s.size());
-    if (len < 0) { return len; }
-    write_len += len;
+    for (auto part : {std::string_view(x.first), std::string_view(": "),
+                      std::string_view(x.second), std::string_view("\r\n")}) {
+      auto len = strm.write(part.data(), part.size());
+      if (len < 0) { return len; }
+      write_len += len;
+    }
   }
   auto len = strm.write("\r\n");
   if (len < 0) { return len; }
@@ -4543,6 +4854,10 @@ write_content_without_length(Stream &strm,
 
   data_sink.done = [&](void) { data_available = false; };
 
+  if (dynamic_cast<SocketStream *>(&strm)) {
+    data_sink.socket = [&]() -> socket_t { return strm.socket(); };
+  }
+
   while (data_available && !is_shutting_down()) {
     if (!strm.is_writable()) {
       return false;
@@ -5695,16 +6010,46 @@ make_bearer_token_authentication_header(const std::string &token,
 }
 
 // Request implementation
+inline const HeaderView *Request::find_header_view(const std::string &key,
+                                                   size_t id) const {
+  for (size_t i = 0; i < header_view_count_; i++) {
+    auto &view = header_views_[i];
+    if (view.name_size == key.size() &&
+        std::equal(key.begin(), key.end(), view.name, [](char a, char b) {
+          return detail::case_ignore::to_lower(a) ==
+                 detail::case_ignore::to_lower(b);
+        })) {
+      if (id == 0) { return &view; }
+      id--;
+    }
+  }
+  return nullptr;
+}
+
 inline bool Request::has_header(const std::string &key) const {
+  if (headers.empty() && header_view_count_) {
+    return find_header_view(key, 0) != nullptr;
+  }
   return detail::has_header(headers, key);
 }
 
 inline std::string Request::get_header_value(const std::string &key,
                                              const char *def, size_t id) const {
+  if (headers.empty() && header_view_count_) {
+    auto view = find_header_view(key, id);
+    return view ? std::string(view->value, view->value_size) : def;
+  }
   return detail::get_header_value(headers, key, def, id);
 }
 
 inline size_t Request::get_header_value_count(const std::string &key) const {
+  if (headers.empty() && header_view_count_) {
+    size_t count = 0;
+    while (find_header_view(key, count)) {
+      count++;
+    }
+    return count;
+  }
   auto r = headers.equal_range(key);
   return static_cast<size_t>(std::distance(r.first, r.second));
 }
@@ -5712,7 +6057,7 @@ inline size_t Request::get_header_value_count(const std::string &key) const {
 inline void Request::set_header(const std::string &key,
                                 const std::string &val) {
   if (!detail::has_crlf(key) && !detail::has_crlf(val)) {
-    headers.emplace(key, val);
+    detail::emplace_header(headers, key, val);
   }
 }
 
@@ -5778,7 +6123,7 @@ inline size_t Response::get_header_value_count(const std::string &key) const {
 inline void Response::set_header(const std::string &key,
                                  const std::string &val) {
   if (!detail::has_crlf(key) && !detail::has_crlf(val)) {
-    headers.emplace(key, val);
+    detail::emplace_header(headers, key, val);
   }
 }
 
@@ -5816,6 +6161,17 @@ inline void Response::set_content(std::string &&s,
   set_header("Content-Type", content_type);
 }
 
+inline void Response::set_serialized_head(std::shared_ptr<const void> owner,
+                                          const char *head, size_t head_length,
+                                          const char *body,
+                                          size_t body_length) {
+  serialized_owner_ = std::move(owner);
+  serialized_head_ = head;
+  serialized_head_length_ = head_length;
+  serialized_body_ = body;
+  serialized_body_length_ = body_length;
+}
+
 inline void Response::set_content_provider(
     size_t in_length, const std::string &content_type, ContentProvider provider,
     ContentProviderResourceReleaser resource_releaser) {
@@ -5892,7 +6248,7 @@ inline SocketStream::SocketStream(socket_t sock, time_t read_timeout_sec,
     : sock_(sock), read_timeout_sec_(read_timeout_sec),
       read_timeout_usec_(read_timeout_usec),
       write_timeout_sec_(write_timeout_sec),
-      write_timeout_usec_(write_timeout_usec), read_buff_(read_buff_size_, 0) {}
+      write_timeout_usec_(write_timeout_usec) {}
 
 inline SocketStream::~SocketStream() = default;
 
@@ -5900,9 +6256,10 @@ inline bool SocketStream::is_readable() const {
   return select_read(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
 }
 
+// a peer that only shut down its sending side still reads what is written
 inline bool SocketStream::is_writable() const {
   return select_write(sock_, write_timeout_sec_, write_timeout_usec_) > 0 &&
-         is_socket_alive(sock_);
+         !is_peer_closed(sock_, false);
 }
 
 inline ssize_t SocketStream::read(char *ptr, size_t size) {
@@ -6004,6 +6361,12 @@ inline socket_t BufferStream::socket() const { return 0; }
 
 inline const std::string &BufferStream::get_buffer() const { return buffer; }
 
+inline void BufferStream::swap_buffer(std::string &other) {
+  buffer.swap(other);
+  buffer.clear();
+  position = 0;
+}
+
 inline PathParamsMatcher::PathParamsMatcher(const std::string &pattern) {
   static constexpr char marker[] = "/:";
 
@@ -6095,6 +6458,111 @@ inline bool PathParamsMatcher::match(Request &request) const {
   return starting_pos >= request.path.length();
 }
 
+inline bool RouteTrie::add(const std::string &pattern, size_t index) {
+  auto has_params = pattern.find("/:") != std::string::npos;
+
+  // without params the pattern is a regex, which is only a plain path if
+  // it has none of the special characters
+  if (pattern.empty() || pattern[0] != '/' ||
+      (!has_params &&
+       pattern.find_first_of("\\^$.|?*+()[]{}") != std::string::npos)) {
+    unindexed_.push_back(index);
+    return false;
+  }
+
+  std::vector<std::string> names;
+  auto node = &root_;
+  auto last_is_param = false;
+
+  for (size_t pos = 1;;) {
+    auto slash = pattern.find('/', pos);
+    auto end = slash == std::string::npos ? pattern.size() : slash;
+    auto segment = pattern.substr(pos, end - pos);
+
+    last_is_param = has_params && !segment.empty() && segment[0] == ':';
+
+    if (last_is_param) {
+      if (names.size() == max_params) {
+        unindexed_.push_back(index);
+        return false;
+      }
+      names.push_back(segment.substr(1));
+      if (!node->param) { node->param = detail::make_unique<Node>(); }
+      node = node->param.get();
+    } else {
+      auto &child = node->children[segment];
+      if (!child) { child = detail::make_unique<Node>(); }
+      node = child.get();
+    }
+
+    if (slash == std::string::npos) { break; }
+    pos = slash + 1;
+  }
+
+  if (index < node->index) { node->index = index; }
+
+  // PathParamsMatcher lets a trailing param be followed by one '/'
+  if (last_is_param) {
+    auto &child = node->children[""];
+    if (!child) { child = detail::make_unique<Node>(); }
+    if (index < child->index) { child->index = index; }
+  }
+
+  if (param_names_.size() <= index) { param_names_.resize(index + 1); }
+  param_names_[index] = std::move(names);
+  return true;
+}
+
+inline size_t RouteTrie::find(const std::string &path,
+                              Captures &captures) const {
+  if (path.empty() || path[0] != '/') { return npos; }
+
+  Captures values;
+  auto best = npos;
+  match(root_, std::string_view(path).substr(1), values, 0, best, captures);
+  return best;
+}
+
+inline void RouteTrie::match(const Node &node, std::string_view rest,
+                             Captures &values, size_t count, size_t &best,
+                             Captures &best_values) const {
+  auto slash = rest.find('/');
+  auto segment = rest.substr(0, slash);
+
+  auto visit = [&](const Node &child, size_t child_count) {
+    if (slash != std::string_view::npos) {
+      match(child, rest.substr(slash + 1), values, child_count, best,
+            best_values);
+    } else if (child.index < best) {
+      best = child.index;
+      std::copy(values.values, values.values + child_count,
+                best_values.values);
+    }
+  };
+
+  auto it = node.children.find(segment);
+  if (it != node.children.end()) { visit(*it->second, count); }
+
+  if (node.param && count < max_params) {
+    values.values[count] = segment;
+    visit(*node.param, count + 1);
+  }
+}
+
+inline void RouteTrie::set_path_params(size_t index, const Captures &captures,
+                                       Request &req) const {
+  const auto &names = param_names_[index];
+
+  req.matches = std::smatch();
+  req.path_params.clear();
+  if (names.empty()) { return; }
+
+  req.path_params.reserve(names.size());
+  for (size_t i = 0; i < names.size(); i++) {
+    req.path_params.emplace(names[i], std::string(captures.values[i]));
+  }
+}
+
 inline bool RegexMatcher::match(Request &request) const {
   request.path_params.clear();
   return std::regex_match(request.path, request.matches, regex_);
@@ -6122,13 +6590,19 @@ Server::make_matcher(const std::string &pattern) {
   }
 }
 
+inline void Server::add_handler(Handlers &handlers, const std::string &pattern,
+                                Handler handler) {
+  handlers.list.emplace_back(make_matcher(pattern), std::move(handler));
+  handlers.routes.add(pattern, handlers.list.size() - 1);
+}
+
 inline Server &Server::Get(const std::string &pattern, Handler handler) {
-  get_handlers_.emplace_back(make_matcher(pattern), std::move(handler));
+  add_handler(get_handlers_, pattern, std::move(handler));
   return *this;
 }
 
 inline Server &Server::Post(const std::string &pattern, Handler handler) {
-  post_handlers_.emplace_back(make_matcher(pattern), std::move(handler));
+  add_handler(post_handlers_, pattern, std::move(handler));
   return *this;
 }
 
@@ -6140,7 +6614,7 @@ inline Server &Server::Post(const std::string &pattern,
 }
 
 inline Server &Server::Put(const std::string &pattern, Handler handler) {
-  put_handlers_.emplace_back(make_matcher(pattern), std::move(handler));
+  add_handler(put_handlers_, pattern, std::move(handler));
   return *this;
 }
 
@@ -6152,7 +6626,7 @@ inline Server &Server::Put(const std::string &pattern,
 }
 
 inline Server &Server::Patch(const std::string &pattern, Handler handler) {
-  patch_handlers_.emplace_back(make_matcher(pattern), std::move(handler));
+  add_handler(patch_handlers_, pattern, std::move(handler));
   return *this;
 }
 
@@ -6164,7 +6638,7 @@ inline Server &Server::Patch(const std::string &pattern,
 }
 
 inline Server &Server::Delete(const std::string &pattern, Handler handler) {
-  delete_handlers_.emplace_back(make_matcher(pattern), std::move(handler));
+  add_handler(delete_handlers_, pattern, std::move(handler));
   return *this;
 }
 
@@ -6176,7 +6650,7 @@ inline Server &Server::Delete(const std::string &pattern,
 }
 
 inline Server &Server::Options(const std::string &pattern, Handler handler) {
-  options_handlers_.emplace_back(make_matcher(pattern), std::move(handler));
+  add_handler(options_handlers_, pattern, std::move(handler));
   return *this;
 }
 
@@ -6299,14 +6773,25 @@ inline Server &Server::set_header_writer(
 
 inline Server &Server::set_keep_alive_max_count(size_t count) {
   keep_alive_max_count_ = count;
+  keep_alive_value_ = keep_alive_value(keep_alive_timeout_sec_, count);
   return *this;
 }
 
 inline Server &Server::set_keep_alive_timeout(time_t sec) {
   keep_alive_timeout_sec_ = sec;
+  keep_alive_value_ = keep_alive_value(sec, keep_alive_max_count_);
   return *this;
 }
 
+inline std::string Server::keep_alive_value(time_t timeout_sec,
+                                            size_t max_count) {
+  std::string s = "timeout=";
+  s += std::to_string(timeout_sec);
+  s += ", max=";
+  s += std::to_string(max_count);
+  return s;
+}
+
 inline Server &Server::set_read_timeout(time_t sec, time_t usec) {
   read_timeout_sec_ = sec;
   read_timeout_usec_ = usec;
@@ -6330,6 +6815,11 @@ inline Server &Server::set_payload_max_length(size_t length) {
   return *this;
 }
 
+inline Server &Server::set_serve_half_closed(bool on) {
+  serve_half_closed_ = on;
+  return *this;
+}
+
 inline bool Server::bind_to_port(const std::string &host, int port,
                                  int socket_flags) {
   auto ret = bind_internal(host, port, socket_flags);
@@ -6439,6 +6929,10 @@ inline bool Server::write_response_core(Stream &strm, bool close_connection,
                                         bool need_apply_ranges) {
   assert(res.status != -1);
 
+  if (res.serialized_head_ && req.ranges.empty() && !post_routing_handler_) {
+    return write_serialized_response(strm, close_connection, req, res);
+  }
+
   if (400 <= res.status && error_handler_ &&
       error_handler_(req, res) == HandlerResponse::Handled) {
     need_apply_ranges = true;
@@ -6448,24 +6942,28 @@ inline bool Server::write_response_core(Stream &strm, bool close_connection,
   std::string boundary;
   if (need_apply_ranges) { apply_ranges(req, res, content_type, boundary); }
 
+  // A protocol switch keeps the handler's Connection: Upgrade, and what
+  // follows is no longer an HTTP body
+  auto switching = res.status == StatusCode::SwitchingProtocol_101;
+
   // Prepare additional headers
-  if (close_connection || req.get_header_value("Connection") == "close") {
+  if (switching) {
+    ;
+  } else if (close_connection ||
+             req.get_header_value("Connection") == "close") {
     res.set_header("Connection", "close");
   } else {
-    std::string s = "timeout=";
-    s += std::to_string(keep_alive_timeout_sec_);
-    s += ", max=";
-    s += std::to_string(keep_alive_max_count_);
-    res.set_header("Keep-Alive", s);
+    res.set_header("Keep-Alive", keep_alive_value_);
   }
 
-  if ((!res.body.empty() || res.content_length_ > 0 || res.content_provider_) &&
+  if (!switching &&
+      (!res.body.empty() || res.content_length_ > 0 || res.content_provider_) &&
       !res.has_header("Content-Type")) {
     res.set_header("Content-Type", "text/plain");
   }
 
-  if (res.body.empty() && !res.content_length_ && !res.content_provider_ &&
-      !res.has_header("Content-Length")) {
+  if (!switching && res.body.empty() && !res.content_length_ &&
+      !res.content_provider_ && !res.has_header("Content-Length")) {
     res.set_header("Content-Length", "0");
   }
 
@@ -6478,12 +6976,17 @@ inline bool Server::write_response_core(Stream &strm, bool close_connection,
   // Response line and headers
   {
     detail::BufferStream bstrm;
+    auto arena = detail::RequestArena::current();
+    if (arena) { bstrm.swap_buffer(arena->head_buffer()); }
+
     if (!detail::write_response_line(bstrm, res.status)) { return false; }
     if (!header_writer_(bstrm, res.headers)) { return false; }
 
     // Flush buffer
     auto &data = bstrm.get_buffer();
     detail::write_data(strm, data.data(), data.size());
+
+    if (arena) { bstrm.swap_buffer(arena->head_buffer()); }
   }
 
   // Body
@@ -6508,6 +7011,60 @@ inline bool Server::write_response_core(Stream &strm, bool close_connection,
   return ret;
 }
 
+inline bool Server::write_serialized_response(Stream &strm,
+                                              bool close_connection,
+                                              const Request &req,
+                                              Response &res) {
+  // the connection header and the blank line, formatted on the stack
+  char tail[128];
+  size_t tail_length;
+  if (close_connection || req.get_header_value("Connection") == "close") {
+    res.set_header("Connection", "close");
+    tail_length = static_cast<size_t>(
+        snprintf(tail, sizeof(tail), "Connection: close\r\n\r\n"));
+  } else {
+    res.set_header("Keep-Alive", keep_alive_value_);
+    tail_length = static_cast<size_t>(snprintf(tail, sizeof(tail),
+                                               "Keep-Alive: %s\r\n\r\n",
+                                               keep_alive_value_.c_str()));
+  }
+
+  auto with_body = req.method != "HEAD" && res.serialized_body_length_ > 0;
+  auto ret = true;
+
+#ifndef _WIN32
+  // Head, connection headers and body in one sendmsg instead of a write
+  // for the headers and more for the body
+  if (auto sock_strm = dynamic_cast<detail::SocketStream *>(&strm)) {
+    struct iovec iov[3];
+    iov[0].iov_base = const_cast<char *>(res.serialized_head_);
+    iov[0].iov_len = res.serialized_head_length_;
+    iov[1].iov_base = tail;
+    iov[1].iov_len = tail_length;
+    iov[2].iov_base = const_cast<char *>(res.serialized_body_);
+    iov[2].iov_len = res.serialized_body_length_;
+
+    ret = sock_strm->is_writable() &&
+          detail::send_socket_vectored(sock_strm->socket(), iov,
+                                       with_body ? 3 : 2,
+                                       CPPHTTPLIB_SEND_FLAGS);
+  } else
+#endif
+  {
+    ret = detail::write_data(strm, res.serialized_head_,
+                             res.serialized_head_length_) &&
+          detail::write_data(strm, tail, tail_length) &&
+          (!with_body || detail::write_data(strm, res.serialized_body_,
+                                            res.serialized_body_length_));
+  }
+
+  if (ret) { res.content_provider_success_ = true; }
+
+  if (logger_) { logger_(req, res); }
+
+  return ret;
+}
+
 inline bool
 Server::write_content_with_provider(Stream &strm, const Request &req,
                                     Response &res, const std::string &boundary,
@@ -6834,8 +7391,8 @@ inline bool Server::listen_internal() {
 #endif
       }
 
-      if (!task_queue->enqueue(
-              [this, sock]() { process_and_close_socket(sock); })) {
+      if (!task_queue->enqueue_connection(
+              sock, [this, sock]() { process_and_close_socket(sock); })) {
         detail::shutdown_socket(sock);
         detail::close_socket(sock);
       }
@@ -6927,15 +7484,27 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm) {
 
 inline bool Server::dispatch_request(Request &req, Response &res,
                                      const Handlers &handlers) const {
-  for (const auto &x : handlers) {
-    const auto &matcher = x.first;
-    const auto &handler = x.second;
+  detail::RouteTrie::Captures captures;
+  auto index = handlers.routes.find(req.path, captures);
+
+  // routes only a regex can match still go first if added first
+  for (auto i : handlers.routes.unindexed()) {
+    if (i > index) { break; }
+
+    const auto &matcher = handlers.list[i].first;
+    const auto &handler = handlers.list[i].second;
 
     if (matcher->match(req)) {
       handler(req, res);
       return true;
     }
   }
+
+  if (index != detail::RouteTrie::npos) {
+    handlers.routes.set_path_params(index, captures, req);
+    handlers.list[index].second(req, res);
+    return true;
+  }
   return false;
 }
 
@@ -7064,7 +7633,8 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
                         int remote_port, const std::string &local_addr,
                         int local_port, bool close_connection,
                         bool &connection_closed,
-                        const std::function<void(Request &)> &setup_request) {
+                        const std::function<void(Request &)> &setup_request,
+                        detail::RequestArena &arena) {
   std::array<char, 2048> buf{};
 
   detail::stream_line_reader line_reader(strm, buf.data(), buf.size());
@@ -7072,11 +7642,15 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
   // Connection has been closed on client
   if (!line_reader.getline()) { return false; }
 
-  Request req;
+  // The connection's objects, reset for its next request when done
+  auto &req = arena.request();
+  auto &res = arena.response();
+  detail::scope_exit reset_arena([&]() { arena.reset(); });
 
-  Response res;
   res.version = "HTTP/1.1";
-  res.headers = default_headers_;
+  for (const auto &header : default_headers_) {
+    detail::emplace_header(res.headers, header.first, header.second);
+  }
 
 #ifdef _WIN32
   // TODO: Increase FD_SETSIZE statically (libzmq), dynamically (MySQL).
@@ -7153,6 +7727,17 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
     }
   }
 
+  // The client gave up while the request waited for a worker
+  if (detail::is_peer_closed(strm.socket(), !serve_half_closed_)) {
+    abandoned_requests_++;
+    connection_closed = true;
+    return false;
+  }
+
+  req.is_connection_closed = [this, &strm]() {
+    return detail::is_peer_closed(strm.socket(), !serve_half_closed_);
+  };
+
   // Routing
   auto routed = false;
 #ifdef CPPHTTPLIB_NO_EXCEPTIONS
@@ -7195,6 +7780,11 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
                                       : StatusCode::PartialContent_206;
     }
 
+    // The connection speaks the new protocol until it closes
+    if (res.status == StatusCode::SwitchingProtocol_101) {
+      connection_closed = true;
+    }
+
     if (detail::range_error(req, res)) {
       res.body.clear();
       res.content_length_ = 0;
@@ -7248,6 +7838,8 @@ inline bool Server::process_and_close_socket(socket_t sock) {
   int local_port = 0;
   detail::get_local_ip_and_port(sock, local_addr, local_port);
 
+  detail::RequestArena arena;
+
   auto ret = detail::process_server_socket(
       svr_sock_, sock, keep_alive_max_count_, keep_alive_timeout_sec_,
       read_timeout_sec_, read_timeout_usec_, write_timeout_sec_,
@@ -7255,7 +7847,7 @@ inline bool Server::process_and_close_socket(socket_t sock) {
       [&](Stream &strm, bool close_connection, bool &connection_closed) {
         return process_request(strm, remote_addr, remote_port, local_addr,
                                local_port, close_connection, connection_closed,
-                               nullptr);
+                               nullptr, arena);
       });
 
   detail::shutdown_socket(sock);
@@ -9207,6 +9799,8 @@ inline bool SSLServer::process_and_close_socket(socket_t sock) {
     int local_port = 0;
     detail::get_local_ip_and_port(sock, local_addr, local_port);
 
+    detail::RequestArena arena;
+
     ret = detail::process_server_socket_ssl(
         svr_sock_, ssl, sock, keep_alive_max_count_, keep_alive_timeout_sec_,
         read_timeout_sec_, read_timeout_usec_, write_timeout_sec_,
@@ -9215,7 +9809,7 @@ inline bool SSLServer::process_and_close_socket(socket_t sock) {
           return process_request(strm, remote_addr, remote_port, local_addr,
                                  local_port, close_connection,
                                  connection_closed,
-                                 [&](Request &req) { req.ssl = ssl; });
+                                 [&](Request &req) { req.ssl = ssl; }, arena);
         });
 
     // Shutdown gracefully if the result seemed successful, non-gracefully if
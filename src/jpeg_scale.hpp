@@ -0,0 +1,97 @@
+#ifndef _JPEG_SCALE_HPP
+#define _JPEG_SCALE_HPP
+
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+  #include <stdio.h>
+  #include <setjmp.h>
+  #include <jpeglib.h>
+}
+
+// Makes a smaller JPEG from a camera frame. libjpeg scales while it
+// decodes, in the DCT, so a 1/2 or 1/4 size copy costs a fraction of a
+// full decode; the pixels stay in YCbCr and are encoded again at the given
+// quality.
+struct JpegScale
+{
+  struct Error
+  {
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+  };
+
+  static void error_exit(j_common_ptr cinfo)
+  {
+    longjmp(((Error *)cinfo->err)->jump, 1);
+  }
+
+  static void no_message(j_common_ptr cinfo)
+  {
+  }
+
+  // false if libjpeg could not read the frame; denom is 2, 4 or 8
+  static bool scale(const char *data, size_t size, unsigned denom, int quality, std::vector<char> &out)
+  {
+    jpeg_decompress_struct decoder;
+    jpeg_compress_struct encoder;
+    Error error;
+    unsigned char *buffer = nullptr;
+    unsigned long length = 0;
+    volatile bool ok = false;
+
+    decoder.err = jpeg_std_error(&error.mgr);
+    encoder.err = &error.mgr;
+    error.mgr.error_exit = error_exit;
+    error.mgr.output_message = no_message;
+
+    jpeg_create_decompress(&decoder);
+    jpeg_create_compress(&encoder);
+
+    if (setjmp(error.jump) == 0)
+    {
+      jpeg_mem_src(&decoder, (unsigned char *)data, size);
+      jpeg_read_header(&decoder, TRUE);
+
+      decoder.scale_num = 1;
+      decoder.scale_denom = denom;
+      decoder.out_color_space = decoder.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_YCbCr;
+      decoder.dct_method = JDCT_IFAST;
+      jpeg_start_decompress(&decoder);
+
+      encoder.image_width = decoder.output_width;
+      encoder.image_height = decoder.output_height;
+      encoder.input_components = decoder.output_components;
+      encoder.in_color_space = decoder.out_color_space;
+      jpeg_set_defaults(&encoder);
+      jpeg_set_quality(&encoder, quality, TRUE);
+      encoder.dct_method = JDCT_IFAST;
+      jpeg_mem_dest(&encoder, &buffer, &length);
+      jpeg_start_compress(&encoder, TRUE);
+
+      JSAMPARRAY row = (*decoder.mem->alloc_sarray)((j_common_ptr)&decoder, JPOOL_IMAGE,
+                                                    decoder.output_width * decoder.output_components, 1);
+
+      while (decoder.output_scanline < decoder.output_height)
+      {
+        jpeg_read_scanlines(&decoder, row, 1);
+        jpeg_write_scanlines(&encoder, row, 1);
+      }
+
+      jpeg_finish_compress(&encoder);
+      jpeg_finish_decompress(&decoder);
+
+      out.assign((const char *)buffer, (const char *)buffer + length);
+      ok = true;
+    }
+
+    jpeg_destroy_compress(&encoder);
+    jpeg_destroy_decompress(&decoder);
+    free(buffer);
+
+    return ok;
+  }
+};
+
+#endif
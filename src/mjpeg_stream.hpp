@@ -0,0 +1,882 @@
+#ifndef _MJPEG_STREAM_HPP
+#define _MJPEG_STREAM_HPP
+
+#include "httpd.hpp"
+#include "camera.hpp"
+#include "rjpg-capture.hpp"
+#include "zerocopy.hpp"
+#include "egress.hpp"
+#include "timer_wheel.hpp"
+#include "jpeg_scale.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+#include <sstream>
+#include <functional>
+
+extern "C" {
+  #include <poll.h>
+  #include <sys/ioctl.h>
+  #include <sys/uio.h>
+  #include <linux/sockios.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+}
+
+// Picks how much of the camera's stream one connection can take.
+//
+// After every part written, the socket's unsent queue (SIOCOUTQ) shows
+// how much of the earlier parts the network had not carried yet when this
+// one went out, and the time the write blocked shows whether the send
+// buffer was full. Either one past its mark means the client can not keep
+// up, and the level goes up at once. The first levels send every frame,
+// scaled down as in scales[level - 1]; past them, the smallest copy is
+// sent for one frame out of (level - scaled_levels) + 1. After raise_wait
+// frames in a row without either, the level comes down by one to probe
+// for more; a probe that congests again doubles the wait before the next
+// one.
+//
+// The throughput is the bytes the queue drained between two writes over
+// the time between them, so it only reaches the link's capacity while
+// the client is behind; otherwise it is the rate actually asked of it.
+struct StreamAdaptation
+{
+  struct Scale
+  {
+    unsigned denom; // of the width and height
+    int quality;
+  };
+
+  static constexpr Scale scales[] = {{2, 70}, {4, 60}};
+  static constexpr int scaled_levels = std::size(scales);
+  static constexpr int max_level = scaled_levels + 5;
+  static constexpr int min_raise_wait = 8;
+  static constexpr int max_raise_wait = 256;
+
+  int level = 0;
+  int phase = 0;
+  int clean = 0;
+  int raise_wait = min_raise_wait;
+  bool started = false;
+  int last_outq = 0;
+  std::chrono::steady_clock::time_point last_write;
+  std::chrono::steady_clock::time_point last_published;
+  uint64_t last_sequence = 0;
+  double frame_interval = 0; // seconds between camera frames
+  double throughput = 0;     // bytes per second the network drained
+
+  std::atomic<int> current_level{0};
+  std::atomic<uint64_t> throughput_bps{0};
+  std::atomic<uint64_t> skipped{0};
+
+  // frames left out for each one sent at the current level
+  int skip_level() const
+  {
+    return std::max(0, level - scaled_levels);
+  }
+
+  // true if this frame is left out at the current level
+  bool skip()
+  {
+    if (phase++ < skip_level())
+    {
+      skipped++;
+      return true;
+    }
+
+    phase = 0;
+    return false;
+  }
+
+  static int send_queue(int sock)
+  {
+    int outq = 0;
+
+    if (ioctl(sock, SIOCOUTQ, &outq) != 0)
+      return 0;
+
+    return outq;
+  }
+
+  // after a part of the given size was written, starting at write_start
+  void update(int sock, const Camera::Frame &frame, size_t bytes, std::chrono::steady_clock::time_point write_start)
+  {
+    auto now = std::chrono::steady_clock::now();
+    int outq = send_queue(sock);
+
+    if (started && frame.sequence > last_sequence)
+    {
+      double interval = std::chrono::duration<double>(frame.published - last_published).count() /
+                        (frame.sequence - last_sequence);
+      double dt = std::chrono::duration<double>(now - last_write).count();
+      double drained = (double)bytes + last_outq - outq;
+      double blocked = std::chrono::duration<double>(now - write_start).count();
+
+      frame_interval = frame_interval == 0 ? interval : frame_interval + (interval - frame_interval) / 8;
+
+      if (dt > 0 && drained > 0)
+        throughput = throughput == 0 ? drained / dt : throughput + (drained / dt - throughput) / 8;
+
+      // unsent when this part was queued, and whether queueing it waited
+      bool behind = outq - (int)bytes > (int)bytes / 2;
+      bool blocking = blocked > frame_interval * (skip_level() + 1) / 2;
+
+      adjust(behind || blocking);
+    }
+
+    started = true;
+    last_outq = outq;
+    last_write = now;
+    last_published = frame.published;
+    last_sequence = frame.sequence;
+
+    current_level = level;
+    throughput_bps = (uint64_t)throughput;
+  }
+
+  void adjust(bool congested)
+  {
+    if (congested)
+    {
+      if (level < max_level)
+        level++;
+
+      if (clean < raise_wait)
+        raise_wait = std::min(max_raise_wait, raise_wait * 2);
+
+      clean = 0;
+    }
+    else if (level > 0 && ++clean >= raise_wait)
+    {
+      level--;
+      clean = 0;
+    }
+  }
+};
+
+// Serves the camera as a multipart/x-mixed-replace MJPEG stream.
+//
+// A distributor thread turns each new frame into a part exactly once: the
+// part header is serialized there and the image bytes are the camera's own
+// shared buffer, so every subscribed connection writes the same memory and
+// the per-viewer cost is only the socket writes.
+//
+// Each connection has a single pending slot rather than a queue. While a
+// slow client is still writing one frame, newer frames replace whatever is
+// pending and the replaced one is counted as dropped, so a slow client only
+// ever falls behind by one frame and never holds up the distributor or the
+// other connections.
+//
+// Low-latency connections additionally cap the kernel send queue with
+// TCP_NOTSENT_LOWAT and only pick up the next frame once the socket has
+// drained below that mark, then send header and image in one writev. The
+// frame a viewer receives is therefore the newest one at the moment the
+// network could actually take it, rather than one that sat in a socket
+// buffer behind older frames.
+//
+// With a zerocopy threshold set, parts of at least that size are sent with
+// MSG_ZEROCOPY; the part is held until the kernel reports it transmitted.
+//
+// With an egress budget set, the distributor only hands a part to the
+// connections the EgressGovernor lets have it, and to none that still have
+// one pending or are writing one.
+//
+// With ?adaptive=1 a connection follows the throughput its network
+// achieves (StreamAdaptation): a slow client first gets every frame at
+// half, then a quarter of the size, and only below that fewer frames,
+// rather than frames that sit in its send queue. The distributor makes
+// the smaller copies once per frame with libjpeg, and only down to the
+// lowest level an adaptive connection is at; a frame libjpeg can not read
+// has none, and is sent whole.
+//
+// With ?paced=1 a connection is not handed frames as the camera delivers
+// them but on a steady schedule, at the camera's frame rate as measured
+// from the driver's capture timestamps. One timer wheel drives every paced
+// connection; each of its ticks offers the newest part to the
+// connections due, and the pacing error is how late the part was then
+// written against its slot.
+struct MjpegStreamer
+{
+  static constexpr const char *boundary = "rjpgframe";
+  static constexpr int low_latency_lowat = 16 * 1024;
+
+  struct Part
+  {
+    Camera::Frame_h frame;
+    std::string header;
+    std::vector<std::shared_ptr<const Part>> scaled; // as StreamAdaptation::scales
+  };
+  typedef std::shared_ptr<const Part> Part_h;
+
+  struct Client
+  {
+    std::string remote;
+    std::mutex mutex;
+    std::condition_variable cond;
+    Part_h pending;
+    std::atomic<bool> writing{false}; // from take() until the part is written
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> dropped{0};
+
+    // low-latency mode: time from frame publish until handed to the kernel
+    bool low_latency = false;
+    bool socket_configured = false;
+    std::atomic<int64_t> last_delay_us{0};
+    std::atomic<int64_t> max_delay_us{0};
+    std::atomic<int64_t> avg_delay_us{0};
+
+    // created on the connection's thread once its socket is known
+    std::unique_ptr<ZeroCopySocket> zerocopy;
+
+    EgressShare egress;
+
+    bool adaptive = false;
+    StreamAdaptation adaptation;
+
+    // paced mode: the timer wheel offers the parts
+    bool paced = false;
+    uint64_t paced_sequence = 0; // timer wheel thread only
+    std::atomic<int64_t> paced_due_ns{0};
+    std::atomic<uint64_t> paced_repeats{0}; // slots without a new frame
+    std::atomic<int64_t> pacing_error_avg_us{0};
+    std::atomic<int64_t> pacing_error_max_us{0};
+
+    void record_pacing_error()
+    {
+      int64_t due = paced_due_ns;
+
+      if (due == 0)
+        return;
+
+      int64_t error = (std::chrono::steady_clock::now().time_since_epoch().count() - due) / 1000;
+
+      if (error > pacing_error_max_us)
+        pacing_error_max_us = error;
+
+      int64_t avg = pacing_error_avg_us;
+      pacing_error_avg_us = avg == 0 ? error : avg + (error - avg) / 8;
+    }
+
+    Client(const std::string &remote_name, bool low_latency_mode)
+      : remote(remote_name), low_latency(low_latency_mode)
+    {
+    }
+
+    void record_delay(const Camera::Frame &frame)
+    {
+      int64_t delay = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - frame.published).count();
+
+      last_delay_us = delay;
+
+      if (delay > max_delay_us)
+        max_delay_us = delay;
+
+      // exponential moving average over roughly the last 8 frames
+      int64_t avg = avg_delay_us;
+      avg_delay_us = avg == 0 ? delay : avg + (delay - avg) / 8;
+    }
+
+    // latest frame wins: an unsent pending part is replaced, not queued
+    void offer(const Part_h &part)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (pending)
+          dropped++;
+
+        pending = part;
+      }
+      cond.notify_one();
+    }
+
+    // nothing pending and nothing being written, so a part offered now
+    // goes out without replacing or waiting behind another
+    bool ready()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return !pending && !writing;
+    }
+
+    // the sender holds a Writing while it writes the part it took
+    Part_h take(std::chrono::milliseconds timeout)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      cond.wait_for(lock, timeout, [this] { return pending != nullptr; });
+
+      Part_h part;
+      part.swap(pending);
+      writing = part != nullptr;
+      return part;
+    }
+
+    struct Writing
+    {
+      Client &client;
+      ~Writing() { client.writing = false; }
+    };
+  };
+  typedef std::shared_ptr<Client> Client_h;
+
+  Camera &_camera;
+  std::mutex _clientsMutex;
+  std::vector<Client_h> _clients;
+  std::atomic<bool> _running{true};
+  std::thread _distributorThread;
+  bool _lowLatencyDefault = false;
+  size_t _zeroCopyThreshold = 0; // 0 sends every part with a copy
+  ZeroCopyStats _zeroCopyStats;
+  EgressGovernor _egress;
+
+  // for paced connections: the newest part and the camera's frame interval
+  std::mutex _latestMutex;
+  Part_h _latestPart;
+  std::chrono::steady_clock::time_point _lastCaptured;
+  uint64_t _lastSequence = 0;
+  std::atomic<int64_t> _frameIntervalNs{0};
+  std::atomic<size_t> _pacedClients{0};
+  TimerWheel _pacer;
+
+  // distributor thread: the smaller copies made for adaptive connections
+  std::atomic<uint64_t> _scaledParts{0};
+  std::atomic<uint64_t> _scaleFailures{0};
+  std::atomic<int64_t> _scaleTimeUs{0};
+
+  // also receives every part, e.g. to feed another server's connections
+  std::mutex _sinkMutex;
+  std::function<void(const Part_h &)> _partSink;
+
+  MjpegStreamer(Camera &camera, bool low_latency_default = false)
+    : _camera(camera), _lowLatencyDefault(low_latency_default)
+  {
+    _distributorThread = std::thread([this] {
+      distributor_loop();
+    });
+  }
+
+  ~MjpegStreamer()
+  {
+    _running = false;
+
+    if (_distributorThread.joinable())
+      _distributorThread.join();
+  }
+
+  std::string content_type() const
+  {
+    return std::string("multipart/x-mixed-replace; boundary=") + boundary;
+  }
+
+  // the CRLF closing the previous part is carried at the front of the next
+  // header so a frame costs two writes: header and image bytes
+  static std::string make_part_header(const Camera::Frame &frame)
+  {
+    return string_format("\r\n--%s\r\n"
+                         "Content-Type: image/jpeg\r\n"
+                         "Content-Length: %zu\r\n"
+                         "X-Frame-Sequence: %llu\r\n"
+                         "\r\n",
+                         boundary, frame.data->size(), (unsigned long long)frame.sequence);
+  }
+
+  // must be set before serving; the stats are shared by every connection
+  void set_zerocopy_threshold(size_t threshold)
+  {
+    _zeroCopyThreshold = threshold;
+  }
+
+  // total bytes per second for every stream together, 0 for no limit;
+  // must be set before serving
+  void set_egress_budget(double bytes_per_sec)
+  {
+    _egress._budget = bytes_per_sec;
+  }
+
+  void set_part_sink(std::function<void(const Part_h &)> sink)
+  {
+    std::lock_guard<std::mutex> lock(_sinkMutex);
+    _partSink = sink;
+  }
+
+  static void set_no_cache_headers(httplib::Response &res)
+  {
+    res.set_header("Cache-Control", "no-cache, no-store");
+    res.set_header("Pragma", "no-cache");
+  }
+
+  void distributor_loop()
+  {
+    uint64_t last_sequence = 0;
+
+    while (_running)
+    {
+      Camera::Frame_h frame = _camera.wait_for_frame(last_sequence, std::chrono::seconds(1));
+
+      if (!frame)
+        continue;
+
+      last_sequence = frame->sequence;
+
+      std::vector<Client_h> clients;
+      {
+        std::lock_guard<std::mutex> lock(_clientsMutex);
+        clients = _clients;
+      }
+
+      std::function<void(const Part_h &)> sink;
+      {
+        std::lock_guard<std::mutex> lock(_sinkMutex);
+        sink = _partSink;
+      }
+
+      measure_frame_interval(*frame);
+
+      if (clients.empty() && !sink)
+        continue;
+
+      auto part = std::make_shared<Part>();
+
+      part->frame = frame;
+      part->header = make_part_header(*frame);
+      add_scaled(*part, scaled_levels_wanted(clients));
+
+      // kept on every frame, so a paced connection that starts while none
+      // is paced is not first offered an old one
+      {
+        std::lock_guard<std::mutex> lock(_latestMutex);
+        _latestPart = part;
+      }
+
+      // paced connections take their parts from the timer wheel
+      if (_pacedClients > 0)
+      {
+        clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                     [](const Client_h &client) { return client->paced; }),
+                      clients.end());
+      }
+
+      if (_egress.enabled())
+        offer_governed(clients, part);
+      else
+      {
+        for (auto &client : clients)
+        {
+          client->offer(part);
+        }
+      }
+
+      if (sink)
+        sink(part);
+    }
+  }
+
+  // the number of smaller copies the adaptive connections need
+  static int scaled_levels_wanted(const std::vector<Client_h> &clients)
+  {
+    int wanted = 0;
+
+    for (auto &client : clients)
+    {
+      if (client->adaptive)
+        wanted = std::max(wanted, std::min<int>(client->adaptation.current_level, StreamAdaptation::scaled_levels));
+    }
+
+    return wanted;
+  }
+
+  // each copy is scaled from the full frame, with the same sequence and
+  // timestamps; stops at the first one that fails
+  void add_scaled(Part &part, int levels)
+  {
+    if (levels == 0)
+      return;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < levels; i++)
+    {
+      const StreamAdaptation::Scale &scale = StreamAdaptation::scales[i];
+      auto data = std::make_shared<Camera::ImageData>();
+      const Camera::ImageData &full = *part.frame->data;
+
+      if (!JpegScale::scale(full.data(), full.size(), scale.denom, scale.quality, *data))
+      {
+        _scaleFailures++;
+        break;
+      }
+
+      auto frame = std::make_shared<Camera::Frame>(*part.frame);
+      auto scaled = std::make_shared<Part>();
+
+      frame->data = data;
+      scaled->frame = frame;
+      scaled->header = make_part_header(*frame);
+      part.scaled.push_back(scaled);
+      _scaledParts++;
+    }
+
+    int64_t took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    int64_t avg = _scaleTimeUs;
+
+    _scaleTimeUs = avg == 0 ? took : avg + (took - avg) / 8;
+  }
+
+  // the copy of the part for the client's level: the smallest there is
+  // up to it, or the part itself
+  static Part_h adapted(Client &client, const Part_h &part)
+  {
+    if (!client.adaptive || part->scaled.empty())
+      return part;
+
+    int level = std::min<int>(client.adaptation.level, part->scaled.size());
+
+    return level == 0 ? part : part->scaled[level - 1];
+  }
+
+  // averaged from the driver's capture timestamps, which do not carry the
+  // jitter of the capture thread's wakeups; cameras without them fall
+  // back to the publish times
+  void measure_frame_interval(const Camera::Frame &frame)
+  {
+    if (_lastSequence != 0 && frame.sequence > _lastSequence && frame.captured > _lastCaptured)
+    {
+      int64_t interval = std::chrono::duration_cast<std::chrono::nanoseconds>(frame.captured - _lastCaptured).count() /
+                         (int64_t)(frame.sequence - _lastSequence);
+      int64_t avg = _frameIntervalNs;
+
+      _frameIntervalNs = avg == 0 ? interval : avg + (interval - avg) / 16;
+    }
+
+    _lastSequence = frame.sequence;
+    _lastCaptured = frame.captured;
+  }
+
+  Part_h latest_part()
+  {
+    std::lock_guard<std::mutex> lock(_latestMutex);
+    return _latestPart;
+  }
+
+  // called by the timer wheel at each of the client's slots
+  TimerWheel::Clock::duration pace(const std::weak_ptr<Client> &weak, TimerWheel::Clock::time_point due)
+  {
+    Client_h client = weak.lock();
+
+    if (!client)
+      return TimerWheel::Clock::duration::zero();
+
+    Part_h part = latest_part();
+
+    if (part && part->frame->sequence != client->paced_sequence)
+    {
+      client->paced_sequence = part->frame->sequence;
+      client->paced_due_ns = due.time_since_epoch().count();
+      client->offer(part);
+    }
+    else
+      client->paced_repeats++;
+
+    int64_t interval = _frameIntervalNs;
+
+    // until the camera has delivered two frames
+    if (interval <= 0)
+      return std::chrono::milliseconds(100);
+
+    return std::chrono::nanoseconds(interval);
+  }
+
+  void start_pacing(const Client_h &client)
+  {
+    std::weak_ptr<Client> weak = client;
+
+    _pacedClients++;
+    _pacer.add(TimerWheel::Clock::now(), [this, weak](TimerWheel::Clock::time_point due) {
+      return pace(weak, due);
+    });
+  }
+
+  void offer_governed(const std::vector<Client_h> &clients, const Part_h &part)
+  {
+    std::vector<Client *> ready;
+    std::vector<EgressShare *> shares;
+    std::vector<bool> send;
+
+    for (auto &client : clients)
+    {
+      if (client->ready())
+      {
+        ready.push_back(client.get());
+        shares.push_back(&client->egress);
+      }
+    }
+
+    _egress.round(shares, part->header.size() + part->frame->data->size(), send);
+
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+      if (send[i])
+        ready[i]->offer(part);
+    }
+  }
+
+  // counts a written part against the client's egress share, and feeds
+  // the adaptation when the socket is known
+  static void sent(Client &client, const Part_h &part, int sock = -1,
+                   std::chrono::steady_clock::time_point write_start = {})
+  {
+    size_t bytes = part->header.size() + part->frame->data->size();
+
+    client.sent++;
+    client.egress.used += bytes;
+
+    if (client.adaptive && sock >= 0)
+      client.adaptation.update(sock, *part->frame, bytes, write_start);
+
+    if (client.paced)
+      client.record_pacing_error();
+  }
+
+  Client_h subscribe(const std::string &remote, bool low_latency, bool adaptive = false, bool paced = false)
+  {
+    auto client = std::make_shared<Client>(remote, low_latency);
+
+    client->adaptive = adaptive;
+    client->paced = paced;
+
+    if (paced)
+      start_pacing(client);
+
+    std::lock_guard<std::mutex> lock(_clientsMutex);
+    _clients.push_back(client);
+    LogDeb("stream client %s connected, %d streaming", remote.c_str(), (int)_clients.size());
+
+    return client;
+  }
+
+  void unsubscribe(const Client_h &client)
+  {
+    // nothing left to pace; the camera's buffer is not held for nobody
+    if (client->paced && --_pacedClients == 0)
+    {
+      std::lock_guard<std::mutex> lock(_latestMutex);
+      _latestPart.reset();
+    }
+
+    std::lock_guard<std::mutex> lock(_clientsMutex);
+
+    for (auto it = _clients.begin(); it != _clients.end(); ++it)
+    {
+      if (*it == client)
+      {
+        _clients.erase(it);
+        break;
+      }
+    }
+
+    LogDeb("stream client %s disconnected after %llu frames, %llu dropped, %d streaming",
+      client->remote.c_str(), (unsigned long long)client->sent, (unsigned long long)client->dropped,
+      (int)_clients.size());
+  }
+
+  // per-client counters in Prometheus text format
+  std::string stats()
+  {
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(_clientsMutex);
+
+    out << "rjpg_stream_clients " << _clients.size() << "\n";
+
+    if (_zeroCopyThreshold > 0)
+      out << _zeroCopyStats.stats("rjpg_stream");
+
+    if (_egress.enabled())
+      out << _egress.stats();
+
+    out << "rjpg_stream_frame_interval_us " << _frameIntervalNs / 1000 << "\n";
+    out << _pacer.stats("rjpg_stream_pacing");
+    out << "rjpg_stream_scaled_parts_total " << _scaledParts << "\n";
+    out << "rjpg_stream_scale_failures_total " << _scaleFailures << "\n";
+    out << "rjpg_stream_scale_time_us " << _scaleTimeUs << "\n";
+
+    for (auto &client : _clients)
+    {
+      out << "rjpg_stream_client_sent_frames{client=\"" << client->remote << "\"} " << client->sent << "\n";
+      out << "rjpg_stream_client_dropped_frames{client=\"" << client->remote << "\"} " << client->dropped << "\n";
+
+      if (client->low_latency)
+      {
+        out << "rjpg_stream_client_queue_delay_us{client=\"" << client->remote << "\",stat=\"last\"} " << client->last_delay_us << "\n";
+        out << "rjpg_stream_client_queue_delay_us{client=\"" << client->remote << "\",stat=\"avg\"} " << client->avg_delay_us << "\n";
+        out << "rjpg_stream_client_queue_delay_us{client=\"" << client->remote << "\",stat=\"max\"} " << client->max_delay_us << "\n";
+      }
+
+      if (_egress.enabled())
+        out << EgressGovernor::share_stats(client->remote, client->egress);
+
+      if (client->adaptive)
+      {
+        out << "rjpg_stream_client_adaptive_level{client=\"" << client->remote << "\"} " << client->adaptation.current_level << "\n";
+        out << "rjpg_stream_client_throughput_bytes_per_second{client=\"" << client->remote << "\"} " << client->adaptation.throughput_bps << "\n";
+        out << "rjpg_stream_client_adaptive_skipped_frames{client=\"" << client->remote << "\"} " << client->adaptation.skipped << "\n";
+      }
+
+      if (client->paced)
+      {
+        out << "rjpg_stream_client_pacing_error_us{client=\"" << client->remote << "\",stat=\"avg\"} " << client->pacing_error_avg_us << "\n";
+        out << "rjpg_stream_client_pacing_error_us{client=\"" << client->remote << "\",stat=\"max\"} " << client->pacing_error_max_us << "\n";
+        out << "rjpg_stream_client_paced_repeats{client=\"" << client->remote << "\"} " << client->paced_repeats << "\n";
+      }
+    }
+
+    return out.str();
+  }
+
+  static void configure_low_latency(int sock)
+  {
+    int lowat = low_latency_lowat;
+    int nodelay = 1;
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0)
+    {
+      LogError("could not set TCP_NOTSENT_LOWAT on socket %d: %d", sock, errno);
+    }
+
+    // no Nagle delay on the tail of a frame, so each writev goes out at once
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) != 0)
+    {
+      LogError("could not set TCP_NODELAY on socket %d: %d", sock, errno);
+    }
+  }
+
+  // true once unsent data has drained below the low-water mark
+  static bool wait_writable(int sock, std::chrono::milliseconds timeout)
+  {
+    struct pollfd pfd = {0};
+
+    pfd.fd = sock;
+    pfd.events = POLLOUT;
+
+    return ::poll(&pfd, 1, (int)timeout.count()) > 0 && (pfd.revents & POLLOUT);
+  }
+
+  // header and image in one writev, or in one zerocopy send
+  bool write_part(Client &client, int sock, const Part_h &part)
+  {
+    const Camera::ImageData &data = *part->frame->data;
+    struct iovec iov[2];
+
+    iov[0].iov_base = const_cast<char *>(part->header.data());
+    iov[0].iov_len = part->header.size();
+    iov[1].iov_base = const_cast<char *>(data.data());
+    iov[1].iov_len = data.size();
+
+    if (_zeroCopyThreshold == 0)
+      return httplib::detail::send_socket_vectored(sock, iov, 2, MSG_NOSIGNAL);
+
+    if (!client.zerocopy)
+      client.zerocopy.reset(new ZeroCopySocket(sock, _zeroCopyThreshold, _zeroCopyStats));
+
+    return client.zerocopy->send(iov, 2, part);
+  }
+
+  bool write_low_latency(Client &client, httplib::DataSink &sink)
+  {
+    int sock = sink.socket();
+
+    if (!client.socket_configured)
+    {
+      configure_low_latency(sock);
+      client.socket_configured = true;
+    }
+
+    // pick the frame only when it can go straight out, so it is the
+    // newest one at that moment
+    if (!wait_writable(sock, std::chrono::seconds(1)))
+      return true;
+
+    Part_h part = client.take(std::chrono::seconds(1));
+    Client::Writing writing{client};
+
+    if (!part || (client.adaptive && client.adaptation.skip()))
+      return true;
+
+    part = adapted(client, part);
+
+    auto write_start = std::chrono::steady_clock::now();
+
+    if (!write_part(client, sock, part))
+      return false;
+
+    client.record_delay(*part->frame);
+    sent(client, part, sock, write_start);
+    return true;
+  }
+
+  void serve(const httplib::Request &req, httplib::Response &res)
+  {
+    bool low_latency = _lowLatencyDefault;
+
+    if (req.has_param("lowlatency"))
+      low_latency = req.get_param_value("lowlatency") != "0";
+
+    bool adaptive = req.has_param("adaptive") && req.get_param_value("adaptive") != "0";
+    bool paced = req.has_param("paced") && req.get_param_value("paced") != "0";
+    Client_h client = subscribe(req.remote_addr + ":" + std::to_string(req.remote_port), low_latency, adaptive, paced);
+
+    set_no_cache_headers(res);
+
+    res.set_content_provider(
+      content_type(),
+      [this, client](size_t offset, httplib::DataSink &sink) {
+        if (client->low_latency && sink.socket)
+          return write_low_latency(*client, sink);
+
+        Part_h part = client->take(std::chrono::seconds(1));
+        Client::Writing writing{*client};
+
+        if (!part)
+          return true; // no new frame yet, keep waiting
+
+        if (client->adaptive && client->adaptation.skip())
+          return true;
+
+        part = adapted(*client, part);
+
+        auto write_start = std::chrono::steady_clock::now();
+
+        if (_zeroCopyThreshold > 0 && sink.socket)
+        {
+          if (!write_part(*client, sink.socket(), part))
+            return false;
+        }
+        else
+        {
+          const Camera::ImageData &data = *part->frame->data;
+
+          if (!sink.write(part->header.data(), part->header.size()) ||
+              !sink.write(data.data(), data.size()))
+            return false;
+        }
+
+        sent(*client, part, sink.socket ? sink.socket() : -1, write_start);
+        return true;
+      },
+      [this, client](bool success) {
+        // the socket is still open here, so late notifications can arrive
+        if (client->zerocopy)
+          client->zerocopy->finish(std::chrono::milliseconds(200));
+
+        unsubscribe(client);
+      });
+  }
+};
+
+#endif
@@ -0,0 +1,334 @@
+#ifndef _RATE_LIMIT_HPP
+#define _RATE_LIMIT_HPP
+
+#include "httpd.hpp"
+#include "rjpg-capture.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct TokenBucket
+{
+  double tokens = 0;
+  bool started = false; // a new bucket starts full
+  std::chrono::steady_clock::time_point updated;
+
+  void refill(double rate, double burst, std::chrono::steady_clock::time_point now)
+  {
+    if (!started)
+      tokens = burst;
+    else
+      tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - updated).count());
+
+    started = true;
+    updated = now;
+  }
+};
+
+// Per-client token buckets for request rate and response bytes.
+//
+// Every request is charged to its address, and to its X-API-Key as well
+// when it sends one. The key is whatever the client says, so it only ever
+// narrows what the address is allowed, never widens it. Each request
+// takes a token from each request bucket; the bytes of its response are
+// taken from the byte buckets afterwards, which may go into debt, since
+// the size is only known once the response is built. A client without a
+// request token, or still in byte debt, is answered 429 with a
+// Retry-After for when it will have enough again.
+//
+// The clients are spread over striped tables, each behind its own mutex,
+// so requests from different clients rarely meet on a lock. Clients whose
+// buckets have been full for a while carry no state worth keeping and are
+// swept out when a stripe grows; a stripe that is still full, e.g. from
+// a flood of made up keys, evicts its least recently seen client.
+struct RateLimiter
+{
+  static constexpr size_t stripe_count = 64;
+  static constexpr size_t stripe_clients = 256; // sweep, then evict, beyond this many
+  static constexpr size_t top_talkers = 5;
+
+  struct Limits
+  {
+    double requests_per_sec = 0; // 0 for no limit
+    double bytes_per_sec = 0;    // 0 for no limit
+    double burst_sec = 2;        // bucket size, in seconds of the rate
+  };
+
+  struct Client
+  {
+    TokenBucket requests;
+    TokenBucket bytes;
+    uint64_t request_count = 0;
+    uint64_t byte_count = 0;
+    uint64_t limited = 0;
+    std::chrono::steady_clock::time_point seen;
+  };
+
+  // who admit() charged a request to, for charge()
+  struct Ticket
+  {
+    std::string address;
+    std::string key;
+  };
+
+  struct alignas(64) Stripe
+  {
+    std::mutex mutex;
+    std::unordered_map<std::string, Client> clients;
+  };
+
+  Limits _limits;
+  Stripe _stripes[stripe_count];
+  std::atomic<uint64_t> _limitedRequests{0};
+  std::atomic<uint64_t> _limitedBytes{0};
+  std::atomic<uint64_t> _swept{0};
+  std::atomic<uint64_t> _evicted{0};
+
+  RateLimiter(const Limits &limits) : _limits(limits) {}
+
+  bool enabled() const
+  {
+    return _limits.requests_per_sec > 0 || _limits.bytes_per_sec > 0;
+  }
+
+  Stripe &stripe(const std::string &client)
+  {
+    return _stripes[std::hash<std::string>()(client) % stripe_count];
+  }
+
+  // the client's entry in its stripe, which the caller has locked; making
+  // room never evicts keep
+  Client &find_client(Stripe &s, const std::string &client, std::chrono::steady_clock::time_point now,
+                      const Client *keep = nullptr)
+  {
+    if (s.clients.size() >= stripe_clients && s.clients.find(client) == s.clients.end())
+      make_room(s, now, keep);
+
+    Client &c = s.clients[client];
+
+    c.seen = now;
+    return c;
+  }
+
+  // refills the client's buckets; returns the seconds until it has a
+  // request token and no byte debt, or 0 when it has them now
+  double wait(Client &c, std::chrono::steady_clock::time_point now)
+  {
+    double wait_sec = 0;
+
+    if (_limits.requests_per_sec > 0)
+    {
+      c.requests.refill(_limits.requests_per_sec, request_burst(), now);
+
+      if (c.requests.tokens < 1)
+      {
+        wait_sec = (1 - c.requests.tokens) / _limits.requests_per_sec;
+        _limitedRequests++;
+      }
+    }
+
+    if (wait_sec == 0 && _limits.bytes_per_sec > 0)
+    {
+      c.bytes.refill(_limits.bytes_per_sec, byte_burst(), now);
+
+      if (c.bytes.tokens < 0)
+      {
+        wait_sec = -c.bytes.tokens / _limits.bytes_per_sec;
+        _limitedBytes++;
+      }
+    }
+
+    if (wait_sec > 0)
+      c.limited++;
+
+    return wait_sec;
+  }
+
+  static void take(Client &c)
+  {
+    c.requests.tokens -= 1;
+    c.request_count++;
+  }
+
+  // checks the address and then the key, and takes a request token from
+  // both only when both allow the request, so one that is turned away
+  // costs neither; returns false after answering 429
+  bool admit(const httplib::Request &req, httplib::Response &res, Ticket &ticket)
+  {
+    if (!enabled())
+      return true;
+
+    auto now = std::chrono::steady_clock::now();
+
+    ticket.address = req.remote_addr;
+
+    if (req.has_header("X-API-Key"))
+      ticket.key = "key:" + req.get_header_value("X-API-Key");
+
+    Stripe &address_stripe = stripe(ticket.address);
+    Stripe *key_stripe = ticket.key.empty() ? nullptr : &stripe(ticket.key);
+    std::unique_lock<std::mutex> address_lock(address_stripe.mutex, std::defer_lock);
+    std::unique_lock<std::mutex> key_lock;
+
+    // both are held until the tokens are taken
+    if (key_stripe && key_stripe != &address_stripe)
+    {
+      key_lock = std::unique_lock<std::mutex>(key_stripe->mutex, std::defer_lock);
+      std::lock(address_lock, key_lock);
+    }
+    else
+      address_lock.lock();
+
+    Client &address = find_client(address_stripe, ticket.address, now);
+    Client *key = nullptr;
+    double wait_sec = wait(address, now);
+
+    if (wait_sec == 0 && key_stripe)
+    {
+      key = &find_client(*key_stripe, ticket.key, now, &address);
+      wait_sec = wait(*key, now);
+    }
+
+    if (wait_sec == 0)
+    {
+      take(address);
+
+      if (key)
+        take(*key);
+
+      return true;
+    }
+
+    ticket.key.clear();
+
+    res.status = httplib::StatusCode::TooManyRequests_429;
+    res.set_header("Retry-After", std::to_string((long long)std::ceil(wait_sec)));
+    return false;
+  }
+
+  void charge(const std::string &client, size_t bytes)
+  {
+    if (client.empty())
+      return;
+
+    Stripe &s = stripe(client);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.clients.find(client);
+
+    if (it == s.clients.end())
+      return;
+
+    it->second.byte_count += bytes;
+
+    if (_limits.bytes_per_sec > 0)
+      it->second.bytes.tokens -= bytes;
+  }
+
+  // takes the response's bytes from the clients admit() charged
+  void charge(const Ticket &ticket, size_t bytes)
+  {
+    charge(ticket.address, bytes);
+    charge(ticket.key, bytes);
+  }
+
+  double request_burst() const { return std::max(1.0, _limits.requests_per_sec * _limits.burst_sec); }
+  double byte_burst() const { return _limits.bytes_per_sec * _limits.burst_sec; }
+
+  // drops the clients idle long enough for their buckets to be full
+  // again, and if that was not enough the one seen longest ago
+  void make_room(Stripe &s, std::chrono::steady_clock::time_point now, const Client *keep = nullptr)
+  {
+    auto idle = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(_limits.burst_sec));
+    auto oldest = s.clients.end();
+
+    for (auto it = s.clients.begin(); it != s.clients.end(); )
+    {
+      if (&it->second == keep)
+      {
+        ++it;
+        continue;
+      }
+
+      if (now - it->second.seen > idle)
+      {
+        it = s.clients.erase(it);
+        _swept++;
+        continue;
+      }
+
+      if (oldest == s.clients.end() || it->second.seen < oldest->second.seen)
+        oldest = it;
+
+      ++it;
+    }
+
+    if (s.clients.size() >= stripe_clients && oldest != s.clients.end())
+    {
+      s.clients.erase(oldest);
+      _evicted++;
+    }
+  }
+
+  // keys are secrets; only their start is shown, and nothing that would
+  // end the label
+  static std::string display_name(const std::string &client)
+  {
+    std::string name = client.compare(0, 4, "key:") == 0 ? client.substr(0, 8) + "..." : client;
+
+    std::replace_if(name.begin(), name.end(), [](char c) { return c == '"' || c == '\\' || c == '\n'; }, '_');
+    return name;
+  }
+
+  std::string stats()
+  {
+    std::ostringstream out;
+
+    out << "rjpg_ratelimit_limited_total{bucket=\"requests\"} " << _limitedRequests << "\n";
+    out << "rjpg_ratelimit_limited_total{bucket=\"bytes\"} " << _limitedBytes << "\n";
+    out << "rjpg_ratelimit_swept_clients_total " << _swept << "\n";
+    out << "rjpg_ratelimit_evicted_clients_total " << _evicted << "\n";
+
+    std::vector<std::pair<std::string, Client>> clients;
+    size_t tracked = 0;
+
+    for (auto &s : _stripes)
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+
+      tracked += s.clients.size();
+
+      for (auto &entry : s.clients)
+        clients.push_back(entry);
+    }
+
+    out << "rjpg_ratelimit_clients " << tracked << "\n";
+
+    size_t top = std::min(top_talkers, clients.size());
+
+    std::partial_sort(clients.begin(), clients.begin() + top, clients.end(), [](auto &a, auto &b) {
+      return a.second.byte_count > b.second.byte_count;
+    });
+
+    for (size_t i = 0; i < top; i++)
+    {
+      std::string name = display_name(clients[i].first);
+
+      out << "rjpg_ratelimit_top_bytes_total{client=\"" << name << "\"} " << clients[i].second.byte_count << "\n";
+      out << "rjpg_ratelimit_top_requests_total{client=\"" << name << "\"} " << clients[i].second.request_count << "\n";
+      out << "rjpg_ratelimit_top_limited_total{client=\"" << name << "\"} " << clients[i].second.limited << "\n";
+    }
+
+    return out.str();
+  }
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef _REQUEST_PARSER_HPP
+#define _REQUEST_PARSER_HPP
+
+#include "httpd.hpp"
+
+#include <cstring>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Parses an HTTP request head in place, without copying or allocating.
+//
+// httplib's parser builds a std::string for every part of the request line
+// and for every header name and value, and a map node per header. Here the
+// request line parts are views into the input buffer, and the header
+// fields go into a fixed array of views that httplib::Request can look
+// headers up in (Request::header_views_), so the buffer must stay as it is
+// until the request has been handled.
+//
+// Line ends are found 16 bytes at a time with SSE2 where available, and
+// with memchr, which the C library vectorizes itself, elsewhere.
+struct FlatRequest
+{
+  static constexpr size_t max_headers = 32;
+
+  enum Result
+  {
+    Ok,
+    Invalid,
+    TooManyHeaders
+  };
+
+  std::string_view method;
+  std::string_view target;
+  std::string_view version;
+  httplib::HeaderView headers[max_headers];
+  size_t header_count = 0;
+
+  static const char *find_char(const char *p, const char *end, char c)
+  {
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+
+    for (; end - p >= 16; p += 16)
+    {
+      __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+      if (mask)
+        return p + __builtin_ctz(mask);
+    }
+#endif
+
+    const char *found = (const char *)memchr(p, c, end - p);
+    return found ? found : end;
+  }
+
+  // the CR of the next CRLF, or end
+  static const char *find_crlf(const char *p, const char *end)
+  {
+    for (;;)
+    {
+      p = find_char(p, end, '\r');
+
+      if (p == end || (end - p >= 2 && p[1] == '\n'))
+        return p;
+
+      if (end - p < 2)
+        return end;
+
+      p++;
+    }
+  }
+
+  // offset of the blank line's CRLF CRLF, or npos if the head is incomplete
+  static size_t find_head_end(const char *begin, const char *end)
+  {
+    for (const char *p = begin; ; )
+    {
+      p = find_crlf(p, end);
+
+      if (end - p < 4)
+        return std::string_view::npos;
+
+      if (p[2] == '\r' && p[3] == '\n')
+        return p - begin;
+
+      p += 2;
+    }
+  }
+
+  static bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+  // begin..end holds the request line and the header lines, each with its
+  // CRLF, but not the blank line
+  Result parse(const char *begin, const char *end)
+  {
+    const char *line_end = find_crlf(begin, end);
+
+    if (line_end == end)
+      return Invalid;
+
+    const char *sp1 = find_char(begin, line_end, ' ');
+    const char *sp2 = sp1 == line_end ? line_end : find_char(sp1 + 1, line_end, ' ');
+
+    if (sp1 == begin || sp2 == line_end || sp2 == sp1 + 1 ||
+        find_char(sp2 + 1, line_end, ' ') != line_end)
+      return Invalid;
+
+    method = std::string_view(begin, sp1 - begin);
+    target = std::string_view(sp1 + 1, sp2 - sp1 - 1);
+    version = std::string_view(sp2 + 1, line_end - sp2 - 1);
+    header_count = 0;
+
+    for (const char *p = line_end + 2; p < end; )
+    {
+      const char *next = find_crlf(p, end);
+
+      if (next == end)
+        return Invalid;
+
+      // no empty names, whitespace before the colon or folded lines
+      const char *colon = find_char(p, next, ':');
+
+      if (colon == next || colon == p || is_blank(colon[-1]) || is_blank(*p))
+        return Invalid;
+
+      if (header_count == max_headers)
+        return TooManyHeaders;
+
+      const char *value = colon + 1;
+      const char *value_end = next;
+
+      while (value < value_end && is_blank(*value))
+        value++;
+
+      while (value_end > value && is_blank(value_end[-1]))
+        value_end--;
+
+      httplib::HeaderView &header = headers[header_count++];
+
+      header.name = p;
+      header.name_size = colon - p;
+      header.value = value;
+      header.value_size = value_end - value;
+
+      p = next + 2;
+    }
+
+    return Ok;
+  }
+};
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef _REUSEPORT_SERVER_HPP
+#define _REUSEPORT_SERVER_HPP
+
+#include "httpd.hpp"
+#include "rjpg-capture.hpp"
+
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <pthread.h>
+  #include <sched.h>
+}
+
+// Several httplib::Server instances sharing one port through SO_REUSEPORT.
+//
+// A single httplib::Server accepts every connection on one thread and
+// hands it to one shared worker pool, with a listen backlog of only
+// CPPHTTPLIB_LISTEN_BACKLOG. Here each acceptor has its own listening
+// socket, so the kernel spreads incoming connections across them, and its
+// own accept thread and worker pool pinned to one core. Worker threads are
+// created by the pinned accept thread and inherit its affinity.
+//
+// The listening sockets get a full SOMAXCONN backlog, TCP_DEFER_ACCEPT so
+// a connection is only handed over once its request has arrived, and
+// TCP_FASTOPEN so returning clients can send the request in the SYN.
+// Accept queue depth per listener and the kernel's listen overflow and
+// drop counters are on /stats.
+struct ReusePortServer
+{
+  // exposes the listening socket of a plain httplib::Server
+  struct Acceptor : public httplib::Server
+  {
+    int index = 0;
+    std::thread thread;
+
+    socket_t listen_socket() const { return svr_sock_; }
+  };
+
+  typedef std::function<httplib::TaskQueue *(size_t worker_count)> TaskQueueFactory;
+
+  std::vector<std::unique_ptr<Acceptor>> _acceptors;
+  std::atomic<bool> _running{false};
+  size_t _workersPerAcceptor;
+  int _deferAcceptSec = 1;
+  int _fastOpenQueue = 256;
+
+  ReusePortServer(int acceptor_count, size_t workers_per_acceptor = 0)
+  {
+    if (acceptor_count <= 0)
+      acceptor_count = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    if (workers_per_acceptor == 0)
+      workers_per_acceptor = std::max<size_t>(4, CPPHTTPLIB_THREAD_POOL_COUNT / acceptor_count);
+
+    _workersPerAcceptor = workers_per_acceptor;
+
+    for (int i = 0; i < acceptor_count; i++)
+    {
+      auto acceptor = std::unique_ptr<Acceptor>(new Acceptor);
+
+      acceptor->index = i;
+      acceptor->set_socket_options([this](socket_t sock) {
+        set_listen_options(sock);
+      });
+
+      _acceptors.push_back(std::move(acceptor));
+    }
+
+    set_task_queue_factory([](size_t worker_count) {
+      return new httplib::ThreadPool(worker_count);
+    });
+  }
+
+  // each acceptor calls the factory for its own worker set
+  ReusePortServer &set_task_queue_factory(TaskQueueFactory factory)
+  {
+    size_t worker_count = _workersPerAcceptor;
+
+    for (auto &acceptor : _acceptors)
+    {
+      acceptor->new_task_queue = [factory, worker_count] {
+        return factory(worker_count);
+      };
+    }
+
+    return *this;
+  }
+
+  ReusePortServer &set_serve_half_closed(bool on)
+  {
+    for (auto &acceptor : _acceptors)
+      acceptor->set_serve_half_closed(on);
+
+    return *this;
+  }
+
+  // 0 turns the option off; must be set before bind_to_port
+  ReusePortServer &set_defer_accept(int sec)
+  {
+    _deferAcceptSec = sec;
+    return *this;
+  }
+
+  ReusePortServer &set_fast_open(int queue_length)
+  {
+    _fastOpenQueue = queue_length;
+    return *this;
+  }
+
+  void set_listen_options(socket_t sock)
+  {
+    httplib::default_socket_options(sock);
+
+    if (_deferAcceptSec > 0 &&
+        setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &_deferAcceptSec, sizeof(_deferAcceptSec)) != 0)
+    {
+      LogError("could not set TCP_DEFER_ACCEPT on socket %d: %d", sock, errno);
+    }
+
+    if (_fastOpenQueue > 0 &&
+        setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &_fastOpenQueue, sizeof(_fastOpenQueue)) != 0)
+    {
+      LogError("could not set TCP_FASTOPEN on socket %d: %d", sock, errno);
+    }
+  }
+
+  ReusePortServer &Get(const std::string &pattern, httplib::Server::Handler handler)
+  {
+    for (auto &acceptor : _acceptors)
+    {
+      acceptor->Get(pattern, handler);
+    }
+
+    return *this;
+  }
+
+  bool bind_to_port(const std::string &host, int port)
+  {
+    for (auto &acceptor : _acceptors)
+    {
+      if (!acceptor->bind_to_port(host, port))
+        return false;
+
+      // httplib listens with a tiny backlog; a second listen() raises it
+      if (::listen(acceptor->listen_socket(), SOMAXCONN) != 0)
+      {
+        LogError("could not raise listen backlog of acceptor %d: %d", acceptor->index, errno);
+      }
+    }
+
+    return true;
+  }
+
+  bool listen_after_bind()
+  {
+    std::atomic<bool> ok{true};
+
+    for (auto &acceptor : _acceptors)
+    {
+      Acceptor *a = acceptor.get();
+
+      a->thread = std::thread([a, &ok] {
+        pin_to_core(a->index);
+
+        if (!a->listen_after_bind())
+          ok = false;
+      });
+    }
+
+    _running = true;
+
+    for (auto &acceptor : _acceptors)
+    {
+      acceptor->thread.join();
+    }
+
+    _running = false;
+    return ok;
+  }
+
+  bool is_running() const { return _running; }
+
+  void wait_until_ready() const
+  {
+    for (auto &acceptor : _acceptors)
+    {
+      acceptor->wait_until_ready();
+    }
+  }
+
+  void stop()
+  {
+    for (auto &acceptor : _acceptors)
+    {
+      acceptor->stop();
+    }
+  }
+
+  // called on the accept thread so the worker pool it creates inherits it
+  static void pin_to_core(int index)
+  {
+    unsigned cores = std::thread::hardware_concurrency();
+
+    if (cores == 0)
+      return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % cores, &cpus);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    {
+      LogDeb("could not pin acceptor %d to core %u", index, index % cores);
+    }
+  }
+
+  // ListenOverflows and ListenDrops from the TcpExt section of
+  // /proc/net/netstat; these are host wide, the kernel keeps no per
+  // socket overflow count
+  static bool read_listen_overflows(uint64_t &overflows, uint64_t &drops)
+  {
+    std::ifstream netstat("/proc/net/netstat");
+    std::string names, values;
+
+    while (std::getline(netstat, names) && std::getline(netstat, values))
+    {
+      if (names.compare(0, 7, "TcpExt:") != 0)
+        continue;
+
+      std::istringstream name_in(names), value_in(values);
+      std::string name, value;
+      int found = 0;
+
+      while (name_in >> name && value_in >> value)
+      {
+        if (name == "ListenOverflows")
+        {
+          overflows = std::stoull(value);
+          found++;
+        }
+        else if (name == "ListenDrops")
+        {
+          drops = std::stoull(value);
+          found++;
+        }
+      }
+
+      return found == 2;
+    }
+
+    return false;
+  }
+
+  std::string stats()
+  {
+    std::ostringstream out;
+
+    for (auto &acceptor : _acceptors)
+    {
+      struct tcp_info info;
+      socklen_t len = sizeof(info);
+
+      // on a listening socket these hold the accept queue length and limit
+      if (getsockopt(acceptor->listen_socket(), IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+        continue;
+
+      out << "rjpg_acceptor_queue_length{acceptor=\"" << acceptor->index << "\"} " << info.tcpi_unacked << "\n";
+      out << "rjpg_acceptor_queue_limit{acceptor=\"" << acceptor->index << "\"} " << info.tcpi_sacked << "\n";
+    }
+
+    uint64_t abandoned = 0;
+
+    for (auto &acceptor : _acceptors)
+      abandoned += acceptor->abandoned_requests();
+
+    out << "rjpg_http_abandoned_requests_total " << abandoned << "\n";
+
+    uint64_t overflows = 0, drops = 0;
+
+    if (read_listen_overflows(overflows, drops))
+    {
+      out << "rjpg_tcp_listen_overflows_total " << overflows << "\n";
+      out << "rjpg_tcp_listen_drops_total " << drops << "\n";
+    }
+
+    return out.str();
+  }
+};
+
+#endif
@@ -9,11 +9,21 @@
 #include <memory>
 #include <chrono>
 #include <iostream>
+#include <functional>
 
 #include "httpd.hpp"
 #include "rjpg-capture.hpp"
 #include "camera_dummy.hpp"
 #include "camera_v4l.hpp"
+#include "capture_image.hpp"
+#include "mjpeg_stream.hpp"
+#include "event_server.hpp"
+#include "uring_server.hpp"
+#include "reuseport_server.hpp"
+#include "task_queue.hpp"
+#include "rate_limit.hpp"
+#include "websocket.hpp"
+#include "frame_events.hpp"
 #include "argparse.hpp"
 
 bool verbose_debug = false;
@@ -67,14 +77,95 @@ struct CustomArgs : public argparse::Args {
     int &width             = kwarg("w,width", "desired frame width").set_default(1280);
     int &height            = kwarg("h,height", "desired frame height").set_default(720);
     int &exposure          = kwarg("e,exposure", "exposure integer").set_default(0);
+    std::string &format_cache = kwarg("f,format-cache", "file caching negotiated camera formats").set_default("/var/tmp/rjpg-capture.formats");
     bool &background       = flag("b,daemon", "background as a daemon");
     bool &dummy_cam        = flag("D,dummy", "use a dummy camera");
     bool &verbose          = flag("v,verbose", "verbose mode");
+    bool &low_latency      = flag("L,low-latency", "stream with minimal socket buffering by default");
+    bool &serve_half_closed = flag("H,serve-half-closed", "answer requests from clients that shut down their sending side, instead of dropping them as abandoned (thread per connection servers)");
+    int &event_loops       = kwarg("E,event-loops", "serve from this many epoll loops instead of a thread per connection; /ws is not served in this mode").set_default(0);
+    bool &io_uring         = flag("U,io-uring", "drive the event loops with io_uring instead of epoll");
+    int &acceptors         = kwarg("A,acceptors", "accept on this many SO_REUSEPORT listeners, each with its own pinned workers").set_default(0);
+    bool &work_stealing    = flag("W,work-stealing", "run request workers from lock-free work-stealing queues");
+    bool &elastic_pool     = flag("P,elastic-pool", "grow and shrink request workers with load, bounded by the CPU quota");
+    int &zerocopy          = kwarg("Z,zerocopy", "send stream frames of at least this many bytes with MSG_ZEROCOPY, 0 for never").set_default(0);
+    int &control_workers   = kwarg("C,control-workers", "workers reserved for /health and /stats connections, 0 to share the image workers").set_default(0);
+    int &queue_deadline    = kwarg("Q,queue-deadline", "answer 503 to connections estimated to wait longer than this many ms for a worker, 0 for never").set_default(0);
+    int &stream_limit      = kwarg("S,stream-limit", "answer 503 to /stream connections beyond this many, 0 for no limit").set_default(0);
+    float &rate_limit      = kwarg("R,rate-limit", "/capture-image requests per second allowed per client, 0 for no limit").set_default(0.0f);
+    float &byte_rate_limit = kwarg("B,byte-rate-limit", "/capture-image bytes per second allowed per client, 0 for no limit").set_default(0.0f);
+    float &egress_budget   = kwarg("G,egress-budget", "bytes per second shared fairly by all /stream connections, 0 for no limit").set_default(0.0f);
     // float &alpha           = kwarg("a,alpha", "An optional float value").set_default(0.5f);
 };
 
+// Binds first so the port is reachable right away, then opens the camera
+// in the background. Returns false if the port or the camera failed.
+template <class HttpServer>
+bool run_server(HttpServer &svr, CustomArgs &args, Camera &camera, const std::function<long long()> &elapsed_ms)
+{
+  if (!svr.bind_to_port("0.0.0.0", args.port))
+  {
+    LogError("Could not bind to port %d", args.port);
+    return false;
+  }
+
+  LogError("listening on port %d after %lld ms", args.port, elapsed_ms());
+
+  // requests are answered with 503 until the first frame arrives
+  std::atomic<bool> camera_failed{false};
+  std::atomic<bool> stopping{false};
+
+  std::thread camera_starter([&]() {
+    try
+    {
+      camera.open(args.src_path, args.width, args.height);
+    }
+    catch(const std::exception& e)
+    {
+      LogError("Could not open camera: %s", e.what());
+      camera_failed = true;
+      svr.wait_until_ready();
+      svr.stop();
+      return;
+    }
+
+    if (args.exposure > 0)
+    {
+      camera.set_control("exposure_mode", "exposure_manual");
+      camera.set_control("exposure_abs", args.exposure);
+    }
+
+    camera.run_reader();
+
+    LogDeb("camera open after %lld ms", elapsed_ms());
+
+    while (!camera.wait_for_frame(0, std::chrono::seconds(1)))
+    {
+      if (stopping)
+        return;
+
+      LogDeb("still waiting for first frame after %lld ms", elapsed_ms());
+    }
+
+    LogError("first frame after %lld ms", elapsed_ms());
+  });
+
+  svr.listen_after_bind();
+
+  stopping = true;
+  camera_starter.join();
+
+  return !camera_failed;
+}
+
 int main(int argc, char* argv[])
 {
+  auto startup_time = std::chrono::steady_clock::now();
+  auto elapsed_ms = [&startup_time]() {
+    return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - startup_time).count();
+  };
+
   auto args = argparse::parse<CustomArgs>(argc, argv);
 
   verbose_debug = args.verbose;
@@ -103,58 +194,247 @@ int main(int argc, char* argv[])
       std::cerr << "please specify a device file with -d or --device\n";
       return 1;
     }
-    camera.reset(new Camera_V4L);
+    camera.reset(new Camera_V4L(args.format_cache));
   }
 
-  try
+  CaptureImage capture(*camera);
+
+  RateLimiter::Limits rate_limits;
+  rate_limits.requests_per_sec = std::max(0.0f, args.rate_limit);
+  rate_limits.bytes_per_sec = std::max(0.0f, args.byte_rate_limit);
+  RateLimiter limiter(rate_limits);
+
+  auto capture_image = [&capture, &limiter](const Request& req, Response& res) {
+    RateLimiter::Ticket client;
+
+    if (!limiter.admit(req, res, client))
+      return;
+
+    capture.serve(req, res);
+    limiter.charge(client, res.body.size() + res.content_length_);
+  };
+
+  auto rate_limit_stats = [&limiter]() {
+    return limiter.enabled() ? limiter.stats() : std::string();
+  };
+
+  MjpegStreamer streamer(*camera, args.low_latency);
+  WebSocketStreamer websocket(*camera);
+  FrameEvents events(*camera);
+  streamer.set_zerocopy_threshold(std::max(0, args.zerocopy));
+  streamer.set_egress_budget(std::max(0.0f, args.egress_budget));
+  auto task_stats = std::make_shared<TaskQueueStats>();
+  auto pool_stats = std::make_shared<ElasticPoolStats>();
+  auto lane_stats = std::make_shared<LaneStats>();
+  auto admission = std::make_shared<AdmissionLimits>();
+  const std::vector<std::string> control_paths = {"/health", "/stats"};
+  bool ok;
+
+  // worker pools for the thread-per-connection servers
+  auto new_image_queue = [&args, task_stats, pool_stats](size_t worker_count) -> httplib::TaskQueue * {
+    if (args.elastic_pool)
+      return new ElasticThreadPool(ElasticThreadPool::Limits::for_cpus(available_cpus(), std::max(1, args.acceptors)), pool_stats);
+
+    if (args.work_stealing)
+      return new WorkStealingQueue(worker_count, task_stats);
+
+    return new httplib::ThreadPool(worker_count);
+  };
+
+  admission->deadline = std::chrono::milliseconds(std::max(0, args.queue_deadline));
+
+  if (args.stream_limit > 0)
+    admission->set_route_limit("/stream", args.stream_limit);
+
+  for (const char *path : {"/stream", "/ws", "/events"})
+    admission->set_streaming(path);
+
+  // wrapping a connection's task costs it an allocation, so only when asked for
+  bool shed_load = args.queue_deadline > 0 || args.stream_limit > 0;
+
+  // only image traffic is shed; the control lane is left alone
+  auto new_task_queue = [&args, &new_image_queue, &control_paths, lane_stats, admission, shed_load](size_t worker_count) -> httplib::TaskQueue * {
+    httplib::TaskQueue *queue = new_image_queue(worker_count);
+    size_t workers = worker_count;
+
+    if (args.elastic_pool)
+      workers = ElasticThreadPool::Limits::for_cpus(available_cpus(), std::max(1, args.acceptors)).max_workers;
+
+    if (shed_load)
+      queue = new AdmissionControl(queue, workers, admission);
+
+    if (args.control_workers <= 0)
+      return queue;
+
+    return new PriorityLanes(queue, args.control_workers, control_paths, lane_stats);
+  };
+
+  auto task_queue_stats = [&args, task_stats, pool_stats, lane_stats, admission, shed_load]() {
+    std::string stats = (shed_load ? admission->stats() : std::string()) +
+                        (args.control_workers > 0 ? lane_stats->stats() : std::string());
+
+    if (args.elastic_pool)
+      return stats + pool_stats->stats();
+
+    return args.work_stealing ? stats + task_stats->stats() : stats;
+  };
+
+  // liveness only: the process is up and serving
+  auto health = [](const Request& req, Response& res) {
+    res.set_content("ok\n", "text/plain");
+  };
+
+  // shared by the epoll and io_uring event servers
+  auto serve_events = [&](auto &svr) {
+    svr.set_wait_timeout(CaptureImage::long_poll_timeout.count());
+    svr.Wait("/capture-image", "capture", [&capture, &limiter](const Request& req, Response& res) {
+      RateLimiter::Ticket client;
+
+      if (!limiter.admit(req, res, client))
+        return false;
+
+      bool wait = capture.serve_event(req, res);
+
+      limiter.charge(client, res.body.size() + res.content_length_);
+      return wait;
+    });
+
+    svr.Stream("/stream", "mjpeg", [&streamer](const Request& req, Response& res) {
+      res.set_header("Content-Type", streamer.content_type());
+      streamer.set_no_cache_headers(res);
+    });
+
+    svr.Stream("/events", "events", [](const Request& req, Response& res) {
+      res.set_header("Content-Type", "text/event-stream");
+      FrameEvents::set_headers(res);
+      res.body = FrameEvents::retry_preamble;
+    }, [&events](const Request& req) {
+      return events.has_latest(req);
+    });
+
+    svr.Get("/stats", [&capture, &streamer, &events, &svr, &rate_limit_stats](const Request& req, Response& res) {
+      res.set_content(capture.stats() + streamer.stats() + events.stats() + svr.stats() + rate_limit_stats(), "text/plain; version=0.0.4");
+    });
+
+    svr.Get("/health", health);
+
+    // the part and the camera's image buffer are shared by every connection
+    streamer.set_part_sink([&svr](const MjpegStreamer::Part_h &part) {
+      auto message = std::make_shared<EventServer::Message>();
+
+      message->push_back(EventServer::Buffer{part, part->header.data(), part->header.size()});
+      message->push_back(EventServer::Buffer{part, part->frame->data->data(), part->frame->data->size()});
+
+      svr.publish("mjpeg", message);
+    });
+
+    // long polls on /capture-image are all answered with the same response
+    capture.set_prepared_sink([&svr](const CaptureImage::Prepared_h &prepared) {
+      auto message = std::make_shared<EventServer::Message>();
+
+      message->push_back(EventServer::Buffer{prepared, prepared->head.data(), prepared->head.size()});
+      message->push_back(EventServer::Buffer{prepared, prepared->frame->data->data(), prepared->frame->data->size()});
+
+      svr.publish("capture", message);
+    });
+
+    // every connection writes the same event text
+    events.set_event_sink([&svr](const FrameEvents::Event_h &event) {
+      auto message = std::make_shared<EventServer::Message>();
+
+      message->push_back(EventServer::Buffer{event, event->text.data(), event->text.size()});
+      svr.publish("events", message);
+    });
+
+    bool served = run_server(svr, args, *camera, elapsed_ms);
+
+    events.set_event_sink(nullptr);
+    capture.set_prepared_sink(nullptr);
+    streamer.set_part_sink(nullptr);
+    return served;
+  };
+
+  if (args.io_uring)
   {
-    camera->open(args.src_path, args.width, args.height);
+    UringServer svr(args.event_loops);
+    ok = serve_events(svr);
   }
-  catch(const std::exception& e)
+  else if (args.event_loops > 0)
   {
-    LogError("Could not open camera: %s", e.what());
-    return 1;
+    EventServer svr(args.event_loops);
+    ok = serve_events(svr);
   }
-  
-  if (args.exposure > 0)
+  else if (args.acceptors > 0)
   {
-    camera->set_control("exposure_mode", "exposure_manual");
-    camera->set_control("exposure_abs", args.exposure);
-  }
+    ReusePortServer svr(args.acceptors);
 
-  httplib::Server svr;
+    svr.set_task_queue_factory(new_task_queue);
+    svr.set_serve_half_closed(args.serve_half_closed);
+    svr.Get("/capture-image", capture_image);
 
-  camera->run_reader();
+    svr.Get("/stream", [&streamer](const Request& req, Response& res) {
+      streamer.serve(req, res);
+    });
 
-  svr.Get("/capture-image", [&camera](const Request& req, Response& res) {
-    if (req.has_header("Content-Length")) {
-      auto val = req.get_header_value("Content-Length");
-    }
-    if (req.has_param("key")) {
-      auto val = req.get_param_value("key");
-    }
+    svr.Get("/ws", [&websocket](const Request& req, Response& res) {
+      websocket.serve(req, res);
+    });
 
+    svr.Get("/events", [&events](const Request& req, Response& res) {
+      events.serve(req, res);
+    });
 
-    try {
-      Camera::ImageData_h data = camera->capture_frame();
+    svr.Get("/stats", [&](const Request& req, Response& res) {
+      res.set_content(capture.stats() + streamer.stats() + websocket.stats() + events.stats() + svr.stats() + task_queue_stats() + rate_limit_stats(), "text/plain; version=0.0.4");
+    });
 
-      if (data->empty())
-      {
-        throw std::runtime_error("no frame data");
-      }
+    svr.Get("/health", health);
 
-      res.set_content(&data->front(), data->size(), "image/jpeg");
-    }
-    catch(std::exception &e) {
-      LogError("could not read image data: %s\n", e.what());
-      throw e;
+    ok = run_server(svr, args, *camera, elapsed_ms);
+  }
+  else
+  {
+    httplib::Server svr;
+
+    svr.new_task_queue = [&new_task_queue] {
+      return new_task_queue(CPPHTTPLIB_THREAD_POOL_COUNT);
+    };
+    svr.set_serve_half_closed(args.serve_half_closed);
+
+    // routes are told apart by the request line at accept
+    if (args.control_workers > 0 || args.stream_limit > 0)
+    {
+      svr.set_socket_options([](socket_t sock) {
+        httplib::default_socket_options(sock);
+        PriorityLanes::defer_accept(sock);
+      });
     }
-  });
 
+    svr.Get("/capture-image", capture_image);
+
+    svr.Get("/stream", [&streamer](const Request& req, Response& res) {
+      streamer.serve(req, res);
+    });
+
+    svr.Get("/ws", [&websocket](const Request& req, Response& res) {
+      websocket.serve(req, res);
+    });
 
-  svr.listen("0.0.0.0", args.port);
+    svr.Get("/events", [&events](const Request& req, Response& res) {
+      events.serve(req, res);
+    });
+
+    svr.Get("/stats", [&](const Request& req, Response& res) {
+      std::string abandoned = string_format("rjpg_http_abandoned_requests_total %llu\n", (unsigned long long)svr.abandoned_requests());
+      res.set_content(capture.stats() + streamer.stats() + websocket.stats() + events.stats() + abandoned + task_queue_stats() + rate_limit_stats(), "text/plain; version=0.0.4");
+    });
+
+    svr.Get("/health", health);
+
+    ok = run_server(svr, args, *camera, elapsed_ms);
+  }
 
   camera->close();
   
-  return 0;
-}
\ No newline at end of file
+  return ok ? 0 : 1;
+}
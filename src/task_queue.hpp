@@ -0,0 +1,970 @@
+#ifndef _TASK_QUEUE_HPP
+#define _TASK_QUEUE_HPP
+
+#include "httpd.hpp"
+#include "rjpg-capture.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+extern "C" {
+  #include <sched.h>
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+}
+
+// A callable kept in fixed inline storage, so queueing one never
+// allocates. Anything that does not fit is rejected at compile time;
+// the std::function httplib hands to enqueue() fits and is only moved.
+struct Task
+{
+  static constexpr size_t capacity = 48;
+
+  alignas(std::max_align_t) unsigned char _storage[capacity];
+  void (*_invoke)(void *) = nullptr;
+  void (*_relocate)(void *to, void *from) = nullptr;
+  void (*_destroy)(void *) = nullptr;
+
+  Task() {}
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  Task(Task &&other) { take(other); }
+
+  Task &operator=(Task &&other)
+  {
+    if (this != &other)
+    {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+
+  ~Task() { reset(); }
+
+  template <class F>
+  void assign(F &&fn)
+  {
+    typedef typename std::decay<F>::type Fn;
+
+    static_assert(sizeof(Fn) <= capacity, "task does not fit the inline storage");
+    static_assert(alignof(Fn) <= alignof(std::max_align_t), "task is over-aligned");
+
+    reset();
+    new (_storage) Fn(std::forward<F>(fn));
+
+    _invoke = [](void *p) { (*static_cast<Fn *>(p))(); };
+    _relocate = [](void *to, void *from) {
+      new (to) Fn(std::move(*static_cast<Fn *>(from)));
+      static_cast<Fn *>(from)->~Fn();
+    };
+    _destroy = [](void *p) { static_cast<Fn *>(p)->~Fn(); };
+  }
+
+  explicit operator bool() const { return _invoke != nullptr; }
+
+  void operator()() { _invoke(_storage); }
+
+  void reset()
+  {
+    if (_destroy)
+      _destroy(_storage);
+
+    _invoke = nullptr;
+    _relocate = nullptr;
+    _destroy = nullptr;
+  }
+
+  void take(Task &other)
+  {
+    if (!other._invoke)
+      return;
+
+    other._relocate(_storage, other._storage);
+
+    _invoke = other._invoke;
+    _relocate = other._relocate;
+    _destroy = other._destroy;
+
+    other._invoke = nullptr;
+    other._relocate = nullptr;
+    other._destroy = nullptr;
+  }
+};
+
+// counters shared by every queue a server creates, for /stats
+struct TaskQueueStats
+{
+  std::atomic<uint64_t> tasks{0};
+  std::atomic<uint64_t> steals{0};
+  std::atomic<uint64_t> rejected{0};
+  std::atomic<uint64_t> parks{0};
+
+  std::string stats() const
+  {
+    std::ostringstream out;
+
+    out << "rjpg_task_queue_tasks_total " << tasks << "\n";
+    out << "rjpg_task_queue_steals_total " << steals << "\n";
+    out << "rjpg_task_queue_rejected_total " << rejected << "\n";
+    out << "rjpg_task_queue_parks_total " << parks << "\n";
+
+    return out.str();
+  }
+};
+
+// httplib::TaskQueue with one lock-free queue per worker and stealing.
+//
+// httplib::ThreadPool keeps every job in one std::list behind one mutex,
+// so each connection costs a list node allocation and two trips through
+// that lock. Here the accept thread spreads tasks round-robin over
+// per-worker bounded queues whose slots hold the Task inline. A worker
+// takes from its own queue first and steals from the others when that is
+// empty, so a worker stuck on a long stream never strands queued
+// connections. Idle workers park on an atomic epoch that enqueue bumps,
+// which costs a futex wake only while someone is actually parked.
+//
+// The queues are bounded; when every one is full enqueue fails and httplib
+// closes the connection, as ThreadPool does with a queued request limit.
+struct WorkStealingQueue : public httplib::TaskQueue
+{
+  static constexpr size_t slots_per_worker = 256;
+
+  // bounded multi-producer multi-consumer ring (Vyukov); every slot's
+  // sequence number says whether it is ready to be written or read
+  struct Ring
+  {
+    struct alignas(64) Slot
+    {
+      std::atomic<size_t> sequence{0};
+      Task task;
+    };
+
+    std::unique_ptr<Slot[]> slots{new Slot[slots_per_worker]};
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+
+    Ring()
+    {
+      for (size_t i = 0; i < slots_per_worker; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(Task &task)
+    {
+      size_t pos = tail.load(std::memory_order_relaxed);
+      Slot *slot;
+
+      for (;;)
+      {
+        slot = &slots[pos & (slots_per_worker - 1)];
+        intptr_t diff = (intptr_t)slot->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+          if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0)
+        {
+          return false; // full
+        }
+        else
+        {
+          pos = tail.load(std::memory_order_relaxed);
+        }
+      }
+
+      slot->task = std::move(task);
+      slot->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(Task &task)
+    {
+      size_t pos = head.load(std::memory_order_relaxed);
+      Slot *slot;
+
+      for (;;)
+      {
+        slot = &slots[pos & (slots_per_worker - 1)];
+        intptr_t diff = (intptr_t)slot->sequence.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+          if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0)
+        {
+          return false; // empty
+        }
+        else
+        {
+          pos = head.load(std::memory_order_relaxed);
+        }
+      }
+
+      task = std::move(slot->task);
+      slot->sequence.store(pos + slots_per_worker, std::memory_order_release);
+      return true;
+    }
+  };
+
+  std::vector<std::unique_ptr<Ring>> _rings;
+  std::vector<std::thread> _threads;
+  std::atomic<size_t> _next{0};
+  std::atomic<uint32_t> _epoch{0};
+  std::atomic<int> _parked{0};
+  std::atomic<bool> _shutdown{false};
+  std::shared_ptr<TaskQueueStats> _stats;
+
+  WorkStealingQueue(size_t worker_count, std::shared_ptr<TaskQueueStats> stats = nullptr)
+    : _stats(stats ? stats : std::make_shared<TaskQueueStats>())
+  {
+    worker_count = std::max<size_t>(1, worker_count);
+
+    for (size_t i = 0; i < worker_count; i++)
+      _rings.emplace_back(new Ring);
+
+    for (size_t i = 0; i < worker_count; i++)
+      _threads.emplace_back([this, i] { worker_loop(i); });
+  }
+
+  ~WorkStealingQueue() override
+  {
+    if (!_shutdown)
+      shutdown();
+  }
+
+  bool enqueue(std::function<void()> fn) override
+  {
+    Task task;
+
+    task.assign(std::move(fn));
+    return enqueue_task(task);
+  }
+
+  bool enqueue_task(Task &task)
+  {
+    size_t start = _next.fetch_add(1, std::memory_order_relaxed);
+    bool queued = false;
+
+    for (size_t i = 0; i < _rings.size() && !queued; i++)
+    {
+      queued = _rings[(start + i) % _rings.size()]->push(task);
+    }
+
+    if (!queued)
+    {
+      _stats->rejected++;
+      return false;
+    }
+
+    _stats->tasks++;
+
+    // a parked worker reads the epoch before its last look at the queues,
+    // so either it sees this task or the epoch has moved and it won't sleep
+    _epoch.fetch_add(1);
+
+    if (_parked.load() > 0)
+      _epoch.notify_one();
+
+    return true;
+  }
+
+  void shutdown() override
+  {
+    _shutdown = true;
+    _epoch.fetch_add(1);
+    _epoch.notify_all();
+
+    for (auto &thread : _threads)
+    {
+      thread.join();
+    }
+
+    _threads.clear();
+  }
+
+  bool take(size_t index, Task &task)
+  {
+    if (_rings[index]->pop(task))
+      return true;
+
+    for (size_t i = 1; i < _rings.size(); i++)
+    {
+      if (_rings[(index + i) % _rings.size()]->pop(task))
+      {
+        _stats->steals++;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void worker_loop(size_t index)
+  {
+    Task task;
+
+    for (;;)
+    {
+      uint32_t epoch = _epoch.load();
+
+      if (take(index, task))
+      {
+        task();
+        task.reset();
+        continue;
+      }
+
+      // queues are drained before exiting, as ThreadPool does
+      if (_shutdown)
+        break;
+
+      _parked++;
+      _stats->parks++;
+      _epoch.wait(epoch);
+      _parked--;
+    }
+  }
+};
+
+// CPUs this process may actually use: the affinity mask, further limited
+// by a cgroup v2 cpu.max quota when one is set
+inline unsigned available_cpus()
+{
+  cpu_set_t cpus;
+  unsigned count = std::max(1u, std::thread::hardware_concurrency());
+
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    count = std::max(1, CPU_COUNT(&cpus));
+
+  // the unified hierarchy is the "0::" line
+  std::ifstream self("/proc/self/cgroup");
+  std::string line, group;
+
+  while (std::getline(self, line))
+  {
+    if (line.compare(0, 3, "0::") == 0)
+      group = line.substr(3);
+  }
+
+  for (const std::string &path : {"/sys/fs/cgroup" + group + "/cpu.max", std::string("/sys/fs/cgroup/cpu.max")})
+  {
+    std::ifstream max(path);
+    std::string quota;
+    double period = 0;
+
+    if (!(max >> quota >> period))
+      continue;
+
+    if (quota != "max" && period > 0)
+    {
+      unsigned quota_cpus = (unsigned)std::max(1.0, std::ceil(std::stod(quota) / period));
+      count = std::min(count, quota_cpus);
+    }
+
+    break;
+  }
+
+  return count;
+}
+
+struct ElasticPoolStats
+{
+  std::atomic<size_t> workers{0};
+  std::atomic<size_t> busy{0};
+  std::atomic<size_t> queued{0};
+  std::atomic<size_t> peak_workers{0};
+  std::atomic<uint64_t> spawned{0};
+  std::atomic<uint64_t> retired{0};
+  std::atomic<uint64_t> tasks{0};
+  std::atomic<uint64_t> wait_us_total{0};
+  std::atomic<int64_t> wait_us_max{0};
+
+  std::string stats() const
+  {
+    std::ostringstream out;
+
+    out << "rjpg_worker_pool_workers " << workers << "\n";
+    out << "rjpg_worker_pool_busy_workers " << busy << "\n";
+    out << "rjpg_worker_pool_queued " << queued << "\n";
+    out << "rjpg_worker_pool_peak_workers " << peak_workers << "\n";
+    out << "rjpg_worker_pool_spawned_total " << spawned << "\n";
+    out << "rjpg_worker_pool_retired_total " << retired << "\n";
+    out << "rjpg_worker_pool_tasks_total " << tasks << "\n";
+    out << "rjpg_worker_pool_queue_wait_us_total " << wait_us_total << "\n";
+    out << "rjpg_worker_pool_queue_wait_us_max " << wait_us_max << "\n";
+
+    return out.str();
+  }
+};
+
+// httplib::TaskQueue whose worker count follows the load.
+//
+// Every streaming client holds a worker for as long as it watches, so a
+// fixed CPPHTTPLIB_THREAD_POOL_COUNT is either too many threads for a
+// one-CPU container or too few for a burst of viewers. This pool starts
+// with min_workers and adds a worker whenever a task is queued while
+// every worker is busy, up to max_workers; a worker that has been idle
+// for idle_timeout exits again, down to min_workers. Workers blocked in a
+// stream use no CPU, so max_workers is a multiple of the CPU count while
+// min_workers is the CPU count itself.
+struct ElasticThreadPool : public httplib::TaskQueue
+{
+  struct Limits
+  {
+    size_t min_workers;
+    size_t max_workers;
+    std::chrono::seconds idle_timeout{30};
+
+    // derived from the CPUs the container may use
+    static Limits for_cpus(unsigned cpus, unsigned share = 1)
+    {
+      Limits limits;
+
+      share = std::max(1u, share);
+      limits.min_workers = std::max<size_t>(2, cpus / share);
+      limits.max_workers = std::max<size_t>(limits.min_workers, 64 * cpus / share);
+      return limits;
+    }
+  };
+
+  struct Job
+  {
+    Task task;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  Limits _limits;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::condition_variable _exitCond;
+  std::deque<Job> _jobs;
+  size_t _workers = 0;
+  size_t _idle = 0;
+  bool _shutdown = false;
+  std::shared_ptr<ElasticPoolStats> _stats;
+
+  ElasticThreadPool(const Limits &limits, std::shared_ptr<ElasticPoolStats> stats = nullptr)
+    : _limits(limits), _stats(stats ? stats : std::make_shared<ElasticPoolStats>())
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    while (_workers < _limits.min_workers)
+      spawn_worker();
+  }
+
+  ~ElasticThreadPool() override
+  {
+    if (!_shutdown)
+      shutdown();
+  }
+
+  // called with _mutex held; workers are detached and counted instead
+  // of joined, since a retiring worker cannot join itself
+  void spawn_worker()
+  {
+    _workers++;
+    _stats->workers++;
+    _stats->spawned++;
+
+    if (_stats->workers > _stats->peak_workers)
+      _stats->peak_workers = _stats->workers.load();
+
+    std::thread([this] { worker_loop(); }).detach();
+  }
+
+  bool enqueue(std::function<void()> fn) override
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _jobs.emplace_back();
+      _jobs.back().task.assign(std::move(fn));
+      _jobs.back().queued = std::chrono::steady_clock::now();
+      _stats->queued++;
+
+      // grow only when no idle worker is left to take this job
+      if (_jobs.size() > _idle && _workers < _limits.max_workers)
+        spawn_worker();
+    }
+
+    _cond.notify_one();
+    return true;
+  }
+
+  void shutdown() override
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _shutdown = true;
+    _cond.notify_all();
+    _exitCond.wait(lock, [this] { return _workers == 0; });
+  }
+
+  void record_wait(const Job &job)
+  {
+    int64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - job.queued).count();
+
+    _stats->tasks++;
+    _stats->wait_us_total += wait;
+
+    if (wait > _stats->wait_us_max)
+      _stats->wait_us_max = wait;
+  }
+
+  void worker_loop()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (;;)
+    {
+      _idle++;
+      bool woken = _cond.wait_for(lock, _limits.idle_timeout, [this] { return !_jobs.empty() || _shutdown; });
+      _idle--;
+
+      if (_jobs.empty())
+      {
+        // queues are drained before exiting, as ThreadPool does
+        if (_shutdown || (!woken && _workers > _limits.min_workers))
+          break;
+
+        continue;
+      }
+
+      Job job = std::move(_jobs.front());
+      _jobs.pop_front();
+      _stats->queued--;
+
+      lock.unlock();
+
+      record_wait(job);
+      _stats->busy++;
+      job.task();
+      job.task.reset();
+      _stats->busy--;
+
+      lock.lock();
+    }
+
+    _workers--;
+    _stats->workers--;
+    _stats->retired++;
+    _exitCond.notify_all();
+  }
+};
+
+// the path of a connection's request line, if it has arrived yet; the
+// bytes stay queued on the socket for the request parser
+inline bool peek_request_path(socket_t sock, std::string &path)
+{
+  char buf[256];
+  ssize_t n = ::recv(sock, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+
+  if (n <= 0)
+    return false;
+
+  std::string_view line(buf, n);
+  size_t start = line.find(' ');
+  size_t end = start == std::string_view::npos ? start : line.find_first_of(" ?", start + 1);
+
+  if (end == std::string_view::npos)
+    return false;
+
+  path = line.substr(start + 1, end - start - 1);
+  return true;
+}
+
+struct LaneStats
+{
+  struct Lane
+  {
+    std::atomic<uint64_t> tasks{0};
+    std::atomic<uint64_t> wait_us_total{0};
+    std::atomic<int64_t> wait_us_max{0};
+
+    void record_wait(std::chrono::steady_clock::time_point queued)
+    {
+      int64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - queued).count();
+
+      tasks++;
+      wait_us_total += wait;
+
+      if (wait > wait_us_max)
+        wait_us_max = wait;
+    }
+  };
+
+  Lane control;
+  Lane image;
+
+  std::string stats() const
+  {
+    std::ostringstream out;
+
+    for (auto lane : {std::make_pair("control", &control), std::make_pair("image", &image)})
+    {
+      out << "rjpg_lane_tasks_total{lane=\"" << lane.first << "\"} " << lane.second->tasks << "\n";
+      out << "rjpg_lane_queue_wait_us_total{lane=\"" << lane.first << "\"} " << lane.second->wait_us_total << "\n";
+      out << "rjpg_lane_queue_wait_us_max{lane=\"" << lane.first << "\"} " << lane.second->wait_us_max << "\n";
+    }
+
+    return out.str();
+  }
+};
+
+// httplib::TaskQueue with a reserved lane for lightweight routes.
+//
+// A worker serves one connection for as long as it lasts, so once image
+// downloads and streams hold every worker of the image lane, a health
+// probe waits behind them until one finishes and the orchestrator gives
+// up on it. Here each accepted connection's request line is peeked at,
+// and connections for a control path (health checks, /stats) are served
+// by a small pool of their own that image traffic never reaches.
+//
+// The request line has to be there when the connection is accepted, so
+// the listening socket should defer accepts until data arrives; a
+// connection that has not sent it yet goes to the image lane.
+struct PriorityLanes : public httplib::TaskQueue
+{
+  std::unique_ptr<httplib::TaskQueue> _image;
+  httplib::ThreadPool _control;
+  std::vector<std::string> _controlPaths;
+  std::shared_ptr<LaneStats> _stats;
+
+  PriorityLanes(httplib::TaskQueue *image, size_t control_workers, const std::vector<std::string> &control_paths,
+                std::shared_ptr<LaneStats> stats = nullptr)
+    : _image(image), _control(control_workers), _controlPaths(control_paths),
+      _stats(stats ? stats : std::make_shared<LaneStats>())
+  {
+  }
+
+  // the task is wrapped to record how long it waited for a worker, at
+  // the cost of an allocation per connection
+  std::function<void()> timed(std::function<void()> fn, LaneStats::Lane &lane)
+  {
+    auto queued = std::chrono::steady_clock::now();
+
+    return [fn = std::move(fn), queued, &lane, stats = _stats] {
+      lane.record_wait(queued);
+      fn();
+    };
+  }
+
+  bool enqueue(std::function<void()> fn) override
+  {
+    return _image->enqueue(timed(std::move(fn), _stats->image));
+  }
+
+  bool enqueue_connection(socket_t sock, std::function<void()> fn) override
+  {
+    if (is_control(sock))
+      return _control.enqueue(timed(std::move(fn), _stats->control));
+
+    return _image->enqueue_connection(sock, timed(std::move(fn), _stats->image));
+  }
+
+  void shutdown() override
+  {
+    _control.shutdown();
+    _image->shutdown();
+  }
+
+  bool is_control(socket_t sock) const
+  {
+    std::string path;
+
+    if (!peek_request_path(sock, path))
+      return false;
+
+    for (auto &control_path : _controlPaths)
+    {
+      if (path == control_path)
+        return true;
+    }
+
+    return false;
+  }
+
+  // so the request line is there to peek at when the connection is accepted
+  static void defer_accept(socket_t sock, int sec = 1)
+  {
+    if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &sec, sizeof(sec)) != 0)
+    {
+      LogError("could not set TCP_DEFER_ACCEPT on socket %d: %d", sock, errno);
+    }
+  }
+};
+
+// limits and counters shared by the admission controls of one server
+struct AdmissionLimits
+{
+  struct Route
+  {
+    std::string path;
+    size_t limit;
+    std::atomic<size_t> active{0};
+    std::atomic<uint64_t> shed{0};
+
+    Route(const std::string &path, size_t limit) : path(path), limit(limit) {}
+
+    // takes one of the route's connections, unless all are taken; the
+    // acceptors of -A may race for the last one
+    bool reserve()
+    {
+      size_t current = active;
+
+      do
+      {
+        if (current >= limit)
+          return false;
+      } while (!active.compare_exchange_weak(current, current + 1));
+
+      return true;
+    }
+  };
+
+  std::chrono::milliseconds deadline{0}; // 0 admits whatever the wait
+  std::deque<Route> routes;              // not changed once serving
+  std::vector<std::string> streaming;    // not changed once serving
+
+  std::atomic<uint64_t> admitted{0};
+  std::atomic<uint64_t> shed_deadline{0};
+  std::atomic<uint64_t> shed_full{0};
+  std::atomic<int64_t> service_us{0};
+  std::atomic<int64_t> estimated_wait_us{0};
+
+  void set_route_limit(const std::string &path, size_t limit)
+  {
+    routes.emplace_back(path, limit);
+  }
+
+  // a connection to this path holds its worker for as long as the client
+  // watches, so its time says nothing about the wait of the next one
+  void set_streaming(const std::string &path)
+  {
+    streaming.push_back(path);
+  }
+
+  bool is_streaming(const std::string &path) const
+  {
+    return std::find(streaming.begin(), streaming.end(), path) != streaming.end();
+  }
+
+  Route *find_route(const std::string &path)
+  {
+    for (auto &route : routes)
+    {
+      if (route.path == path)
+        return &route;
+    }
+
+    return nullptr;
+  }
+
+  std::string stats()
+  {
+    std::ostringstream out;
+
+    out << "rjpg_admission_admitted_total " << admitted << "\n";
+    out << "rjpg_admission_shed_total{reason=\"deadline\"} " << shed_deadline << "\n";
+    out << "rjpg_admission_shed_total{reason=\"queue_full\"} " << shed_full << "\n";
+
+    for (auto &route : routes)
+    {
+      out << "rjpg_admission_shed_total{reason=\"route\",path=\"" << route.path << "\"} " << route.shed << "\n";
+      out << "rjpg_admission_route_active{path=\"" << route.path << "\"} " << route.active << "\n";
+    }
+
+    out << "rjpg_admission_service_us " << service_us << "\n";
+    out << "rjpg_admission_estimated_wait_us " << estimated_wait_us << "\n";
+
+    return out.str();
+  }
+};
+
+// httplib::TaskQueue that turns connections away with a 503 when they
+// would not be served in time.
+//
+// httplib only ever refuses a connection when a queue is full, and then
+// closes it without a word, so under overload clients see resets or sit
+// in the queue until they time out. Here the wait for a worker is
+// estimated when a connection is accepted: nothing while a worker is
+// free, otherwise the connections ahead of it times the measured mean
+// time a worker spends on a connection, spread over the workers. When
+// that is past the deadline, or the connection's route already has its
+// limit of connections, or the queue refuses it, the client gets a 503
+// with a Retry-After right away and the connection is closed.
+//
+// Routes are told apart by the request line, which must have arrived when
+// the connection is accepted, as for PriorityLanes; a keep-alive
+// connection counts against the route of its first request. Connections
+// to streaming routes are left out of the mean time a worker spends on
+// one.
+struct AdmissionControl : public httplib::TaskQueue
+{
+  std::unique_ptr<httplib::TaskQueue> _queue;
+  size_t _workers;
+  std::shared_ptr<AdmissionLimits> _limits;
+  std::atomic<size_t> _queued{0};
+  std::atomic<size_t> _busy{0};
+  std::atomic<int64_t> _serviceUs{0};
+
+  AdmissionControl(httplib::TaskQueue *queue, size_t workers, std::shared_ptr<AdmissionLimits> limits)
+    : _queue(queue), _workers(std::max<size_t>(1, workers)), _limits(limits)
+  {
+  }
+
+  bool enqueue(std::function<void()> fn) override
+  {
+    if (_queue->enqueue(admitted(std::move(fn), nullptr, false)))
+      return true;
+
+    _queued--;
+    return false;
+  }
+
+  bool enqueue_connection(socket_t sock, std::function<void()> fn) override
+  {
+    AdmissionLimits::Route *route = nullptr;
+    bool streaming = false;
+    std::string path;
+
+    if ((!_limits->routes.empty() || !_limits->streaming.empty()) && peek_request_path(sock, path))
+    {
+      route = _limits->find_route(path);
+      streaming = _limits->is_streaming(path);
+    }
+
+    if (route && !route->reserve())
+    {
+      route->shed++;
+      reject(sock, 1);
+      return false;
+    }
+
+    int64_t wait_us = estimated_wait_us();
+
+    _limits->estimated_wait_us = wait_us;
+
+    if (_limits->deadline.count() > 0 && wait_us > _limits->deadline.count() * 1000)
+    {
+      if (route)
+        route->active--;
+
+      _limits->shed_deadline++;
+      reject(sock, (int)std::min<int64_t>(60, wait_us / 1000000 + 1));
+      return false;
+    }
+
+    if (!_queue->enqueue_connection(sock, admitted(std::move(fn), route, streaming)))
+    {
+      // the task was dropped without running
+      _queued--;
+
+      if (route)
+        route->active--;
+
+      _limits->shed_full++;
+      reject(sock, 1);
+      return false;
+    }
+
+    _limits->admitted++;
+    return true;
+  }
+
+  void shutdown() override
+  {
+    _queue->shutdown();
+  }
+
+  int64_t estimated_wait_us() const
+  {
+    size_t queued = _queued;
+
+    if (_busy + queued < _workers)
+      return 0;
+
+    return (int64_t)(queued + 1) * _serviceUs / (int64_t)_workers;
+  }
+
+  // the task is wrapped to keep the queue and busy counts and to measure
+  // how long it holds its worker; the wrapper is too big for
+  // std::function's inline storage, so this allocates per connection
+  std::function<void()> admitted(std::function<void()> fn, AdmissionLimits::Route *route, bool streaming)
+  {
+    _queued++;
+
+    return [this, fn = std::move(fn), route, streaming] {
+      _queued--;
+      _busy++;
+
+      auto start = std::chrono::steady_clock::now();
+
+      fn();
+
+      int64_t service = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+      // moving average over roughly the last eight connections
+      if (!streaming)
+      {
+        int64_t average = _serviceUs;
+        average = average == 0 ? service : average + (service - average) / 8;
+        _serviceUs = average;
+        _limits->service_us = average;
+      }
+
+      _busy--;
+
+      if (route)
+        route->active--;
+    };
+  }
+
+  // answers the unread request and drains it, so closing the socket does
+  // not reset the connection before the client has read the answer
+  static void reject(socket_t sock, int retry_after_sec)
+  {
+    std::string response = string_format("HTTP/1.1 503 Service Unavailable\r\n"
+                                          "Retry-After: %d\r\n"
+                                          "Content-Length: 0\r\n"
+                                          "Connection: close\r\n"
+                                          "\r\n",
+                                          retry_after_sec);
+    char discard[4096];
+
+    ::send(sock, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    while (::recv(sock, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+      ;
+  }
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef _TIMER_WHEEL_HPP
+#define _TIMER_WHEEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs periodic callbacks from one thread on a hashed timing wheel.
+//
+// Time is cut into ticks and every timer sits in the slot of the tick it
+// is due in, modulo the number of slots, so adding a timer and finding
+// the ones due are constant time however many there are. The thread
+// sleeps once per tick for all timers together, and not at all while
+// there are none.
+//
+// A callback gets the time it was due and returns the period to its next
+// call, or zero to stop. The next call is due one period after the last
+// due time, so lateness does not accumulate; a timer that fell more than
+// a period behind, e.g. after the machine stalled, restarts from now
+// instead of firing to catch up.
+struct TimerWheel
+{
+  typedef std::chrono::steady_clock Clock;
+  typedef std::function<Clock::duration(Clock::time_point due)> Callback;
+
+  static constexpr size_t slot_count = 512;
+
+  struct Timer
+  {
+    Clock::time_point due;
+    Callback callback;
+  };
+
+  Clock::duration _tick;
+  Clock::time_point _start;
+  uint64_t _current = 0; // last tick processed
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::vector<Timer> _slots[slot_count];
+  size_t _timers = 0;
+  bool _running = true;
+  std::thread _thread;
+
+  std::atomic<uint64_t> _fired{0};
+  std::atomic<uint64_t> _lateUsTotal{0};
+  std::atomic<int64_t> _lateUsMax{0};
+
+  TimerWheel(Clock::duration tick = std::chrono::milliseconds(1))
+    : _tick(tick), _start(Clock::now())
+  {
+    _thread = std::thread([this] {
+      run();
+    });
+  }
+
+  ~TimerWheel()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _running = false;
+    }
+    _cond.notify_all();
+
+    if (_thread.joinable())
+      _thread.join();
+  }
+
+  void add(Clock::time_point due, Callback callback)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      insert(Timer{due, std::move(callback)});
+    }
+    _cond.notify_one();
+  }
+
+  uint64_t tick_of(Clock::time_point when) const
+  {
+    return when <= _start ? 0 : (when - _start) / _tick;
+  }
+
+  // the first tick that starts at or after when, so no timer fires early
+  uint64_t due_tick(Clock::time_point when) const
+  {
+    return when <= _start ? 0 : (when - _start + _tick - Clock::duration(1)) / _tick;
+  }
+
+  // with the mutex held
+  void insert(Timer &&timer)
+  {
+    uint64_t tick = std::max(due_tick(timer.due), _current + 1);
+
+    _slots[tick % slot_count].push_back(std::move(timer));
+    _timers++;
+  }
+
+  void run()
+  {
+    std::vector<Timer> due;
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (_running)
+    {
+      if (_timers == 0)
+      {
+        _cond.wait(lock, [this] { return _timers > 0 || !_running; });
+        continue;
+      }
+
+      lock.unlock();
+      std::this_thread::sleep_until(_start + (_current + 1) * _tick);
+      lock.lock();
+
+      auto now = Clock::now();
+      uint64_t target = tick_of(now);
+
+      // every slot at most once, however long the sleep overran
+      uint64_t first = target - _current > slot_count ? target - slot_count + 1 : _current + 1;
+
+      for (uint64_t tick = first; tick <= target; tick++)
+      {
+        std::vector<Timer> &slot = _slots[tick % slot_count];
+
+        for (size_t i = 0; i < slot.size(); )
+        {
+          if (due_tick(slot[i].due) <= target)
+          {
+            due.push_back(std::move(slot[i]));
+
+            if (i + 1 < slot.size())
+              slot[i] = std::move(slot.back());
+
+            slot.pop_back();
+            _timers--;
+          }
+          else
+            i++;
+        }
+      }
+
+      _current = std::max(_current, target);
+      lock.unlock();
+
+      for (auto &timer : due)
+      {
+        int64_t late = std::chrono::duration_cast<std::chrono::microseconds>(now - timer.due).count();
+
+        _fired++;
+        _lateUsTotal += std::max<int64_t>(0, late);
+
+        if (late > _lateUsMax)
+          _lateUsMax = late;
+
+        Clock::duration period = timer.callback(timer.due);
+
+        if (period.count() <= 0)
+        {
+          timer.callback = nullptr;
+          continue;
+        }
+
+        timer.due += period;
+
+        if (timer.due + period < now)
+          timer.due = now + period;
+      }
+
+      lock.lock();
+
+      for (auto &timer : due)
+      {
+        if (timer.callback)
+          insert(std::move(timer));
+      }
+
+      due.clear();
+    }
+  }
+
+  std::string stats(const char *prefix) const
+  {
+    std::ostringstream out;
+
+    out << prefix << "_timer_fired_total " << _fired << "\n";
+    out << prefix << "_timer_late_us_total " << _lateUsTotal << "\n";
+    out << prefix << "_timer_late_us_max " << _lateUsMax << "\n";
+
+    return out.str();
+  }
+};
+
+#endif
@@ -0,0 +1,608 @@
+#ifndef _WEBSOCKET_HPP
+#define _WEBSOCKET_HPP
+
+#include "httpd.hpp"
+#include "camera.hpp"
+#include "rjpg-capture.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+  #include <sys/socket.h>
+  #include <sys/uio.h>
+}
+
+// RFC 6455 pieces: the handshake digest and frame headers
+struct WebSocket
+{
+  enum Opcode
+  {
+    Continuation = 0x0,
+    Text = 0x1,
+    Binary = 0x2,
+    Close = 0x8,
+    Ping = 0x9,
+    Pong = 0xA
+  };
+
+  static constexpr size_t max_message = 4096; // from clients
+  static constexpr size_t max_control = 125;
+
+  // close payloads: the status code, big-endian
+  static constexpr const char protocol_error[2] = {'\x03', '\xea'};   // 1002
+  static constexpr const char policy_violation[2] = {'\x03', '\xf0'}; // 1008
+
+  static std::string sha1(const std::string &message)
+  {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string data = message;
+    uint64_t bits = (uint64_t)message.size() * 8;
+
+    data += (char)0x80;
+
+    while (data.size() % 64 != 56)
+      data += (char)0;
+
+    for (int i = 7; i >= 0; i--)
+      data += (char)(bits >> (i * 8));
+
+    auto rol = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+
+    for (size_t chunk = 0; chunk < data.size(); chunk += 64)
+    {
+      uint32_t w[80];
+
+      for (int i = 0; i < 16; i++)
+      {
+        const unsigned char *p = (const unsigned char *)data.data() + chunk + i * 4;
+        w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+      }
+
+      for (int i = 16; i < 80; i++)
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+      uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+      for (int i = 0; i < 80; i++)
+      {
+        uint32_t f, k;
+
+        if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+        uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = rol(b, 30); b = a; a = t;
+      }
+
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    std::string digest;
+
+    for (uint32_t v : h)
+      for (int i = 3; i >= 0; i--)
+        digest += (char)(v >> (i * 8));
+
+    return digest;
+  }
+
+  static std::string accept_key(const std::string &key)
+  {
+    return httplib::detail::base64_encode(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+  }
+
+  // the header of an unmasked, unfragmented server frame
+  static std::string frame_header(Opcode opcode, uint64_t length)
+  {
+    std::string header;
+
+    header += (char)(0x80 | opcode);
+
+    if (length < 126)
+      header += (char)length;
+    else if (length <= 0xFFFF)
+    {
+      header += (char)126;
+      header += (char)(length >> 8);
+      header += (char)length;
+    }
+    else
+    {
+      header += (char)127;
+      for (int i = 7; i >= 0; i--)
+        header += (char)(length >> (i * 8));
+    }
+
+    return header;
+  }
+
+  static void put_u64(std::string &out, uint64_t v)
+  {
+    for (int i = 7; i >= 0; i--)
+      out += (char)(v >> (i * 8));
+  }
+
+  // one complete masked frame from a client at the front of in, or false
+  // if it has not all arrived or can not be taken; then error is the close
+  // payload to answer with, or null. payload is unmasked
+  static bool parse_frame(std::string &in, bool &fin, int &opcode, std::string &payload, const char *&error)
+  {
+    const unsigned char *p = (const unsigned char *)in.data();
+    size_t have = in.size();
+
+    error = nullptr;
+
+    if (have < 2)
+      return false;
+
+    fin = p[0] & 0x80;
+    opcode = p[0] & 0x0F;
+
+    bool masked = p[1] & 0x80;
+    uint64_t length = p[1] & 0x7F;
+    size_t pos = 2;
+
+    if (length == 126)
+    {
+      if (have < 4)
+        return false;
+
+      length = (uint64_t)p[2] << 8 | p[3];
+      pos = 4;
+    }
+    else if (length == 127)
+    {
+      if (have < 10)
+        return false;
+
+      length = 0;
+      for (int i = 0; i < 8; i++)
+        length = length << 8 | p[2 + i];
+      pos = 10;
+    }
+
+    // clients must mask (RFC 6455 5.1), and only send small messages here
+    if (!masked || length > max_message)
+    {
+      error = masked ? policy_violation : protocol_error;
+      return false;
+    }
+
+    if (have < pos + 4 + length)
+      return false;
+
+    const unsigned char *mask = p + pos;
+    pos += 4;
+
+    payload.assign(in, pos, length);
+
+    for (size_t i = 0; i < payload.size(); i++)
+      payload[i] ^= mask[i % 4];
+
+    in.erase(0, pos + length);
+    return true;
+  }
+};
+
+// Pushes every camera frame as one binary WebSocket message on /ws.
+//
+// A message is a 20 byte big-endian metadata header (frame sequence,
+// capture time in microseconds since the epoch, JPEG size) followed by
+// the JPEG. A distributor thread builds the WebSocket frame header and
+// the metadata once per frame; every connection sends that prefix and
+// the camera's own image buffer in one writev, so no connection copies
+// the image. Each connection has one pending slot, as for MjpegStreamer:
+// a client that falls behind skips frames instead of queueing them.
+//
+// Clients may send text messages:
+//   fps=N              at most N frames per second, 0 for every frame
+//   resolution=WxH     answered with an error: the camera's frames are
+//                      shared JPEGs and there is no scaler
+// Pings are answered and a close is echoed before the connection ends.
+// Fragmented messages are acted on once complete. A control frame that is
+// fragmented or longer than 125 bytes, an unmasked frame, or a frame out
+// of sequence, ends the connection with 1002; frames skipped for fps
+// count as dropped.
+//
+// Only the thread per connection servers, the default one and -A, serve
+// /ws: a connection here reads the client's frames on its own thread, and
+// the event servers' streams (-E, -U) only ever write.
+struct WebSocketStreamer
+{
+  struct Part
+  {
+    Camera::Frame_h frame;
+    std::string prefix; // frame header and metadata
+  };
+  typedef std::shared_ptr<const Part> Part_h;
+
+  struct Client
+  {
+    std::string remote;
+    std::mutex mutex;
+    std::condition_variable cond;
+    Part_h pending;
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> messages{0};
+    std::atomic<int> fps{0};
+
+    // the connection's thread only
+    std::string in;
+    std::chrono::steady_clock::time_point last_sent;
+    int message_opcode = 0; // of a fragmented message being received
+    std::string message;
+
+    Client(const std::string &remote_name) : remote(remote_name) {}
+
+    void offer(const Part_h &part)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (pending)
+          dropped++;
+
+        pending = part;
+      }
+      cond.notify_one();
+    }
+
+    Part_h take(std::chrono::milliseconds timeout)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      cond.wait_for(lock, timeout, [this] { return pending != nullptr; });
+
+      Part_h part;
+      part.swap(pending);
+      return part;
+    }
+  };
+  typedef std::shared_ptr<Client> Client_h;
+
+  static constexpr size_t metadata_size = 20;
+
+  Camera &_camera;
+  std::mutex _clientsMutex;
+  std::vector<Client_h> _clients;
+  std::atomic<bool> _running{true};
+  std::thread _distributorThread;
+
+  std::atomic<uint64_t> _handshakes{0};
+  std::atomic<uint64_t> _rejected{0};
+
+  WebSocketStreamer(Camera &camera) : _camera(camera)
+  {
+    _distributorThread = std::thread([this] {
+      distributor_loop();
+    });
+  }
+
+  ~WebSocketStreamer()
+  {
+    _running = false;
+
+    if (_distributorThread.joinable())
+      _distributorThread.join();
+  }
+
+  static Part_h make_part(const Camera::Frame_h &frame)
+  {
+    auto part = std::make_shared<Part>();
+    uint64_t timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      frame->timestamp.time_since_epoch()).count();
+    uint32_t size = frame->data->size();
+
+    part->frame = frame;
+    part->prefix = WebSocket::frame_header(WebSocket::Binary, metadata_size + size);
+    WebSocket::put_u64(part->prefix, frame->sequence);
+    WebSocket::put_u64(part->prefix, timestamp_us);
+
+    for (int i = 3; i >= 0; i--)
+      part->prefix += (char)(size >> (i * 8));
+
+    return part;
+  }
+
+  void distributor_loop()
+  {
+    uint64_t last_sequence = 0;
+
+    while (_running)
+    {
+      Camera::Frame_h frame = _camera.wait_for_frame(last_sequence, std::chrono::seconds(1));
+
+      if (!frame)
+        continue;
+
+      last_sequence = frame->sequence;
+
+      std::vector<Client_h> clients;
+      {
+        std::lock_guard<std::mutex> lock(_clientsMutex);
+        clients = _clients;
+      }
+
+      if (clients.empty() || !frame->data || frame->data->empty())
+        continue;
+
+      Part_h part = make_part(frame);
+
+      for (auto &client : clients)
+      {
+        client->offer(part);
+      }
+    }
+  }
+
+  Client_h subscribe(const std::string &remote)
+  {
+    auto client = std::make_shared<Client>(remote);
+
+    std::lock_guard<std::mutex> lock(_clientsMutex);
+    _clients.push_back(client);
+    LogDeb("websocket client %s connected, %d connected", remote.c_str(), (int)_clients.size());
+
+    return client;
+  }
+
+  void unsubscribe(const Client_h &client)
+  {
+    std::lock_guard<std::mutex> lock(_clientsMutex);
+
+    for (auto it = _clients.begin(); it != _clients.end(); ++it)
+    {
+      if (*it == client)
+      {
+        _clients.erase(it);
+        break;
+      }
+    }
+
+    LogDeb("websocket client %s disconnected after %llu frames, %d connected",
+      client->remote.c_str(), (unsigned long long)client->sent, (int)_clients.size());
+  }
+
+  static bool send_message(httplib::DataSink &sink, WebSocket::Opcode opcode, const std::string &payload)
+  {
+    std::string frame = WebSocket::frame_header(opcode, payload.size()) + payload;
+    return sink.write(frame.data(), frame.size());
+  }
+
+  // false once the connection should end
+  bool handle_message(Client &client, httplib::DataSink &sink, int opcode, const std::string &payload)
+  {
+    client.messages++;
+
+    switch (opcode)
+    {
+    case WebSocket::Ping:
+      return send_message(sink, WebSocket::Pong, payload);
+
+    case WebSocket::Close:
+      // echo the status code, then end the connection
+      send_message(sink, WebSocket::Close, payload.substr(0, 2));
+      return false;
+
+    case WebSocket::Text:
+      if (payload.compare(0, 4, "fps=") == 0)
+      {
+        client.fps = std::max(0, atoi(payload.c_str() + 4));
+        return true;
+      }
+
+      if (payload.compare(0, 11, "resolution=") == 0)
+        return send_message(sink, WebSocket::Text, "{\"error\":\"resolution changes are not supported\"}");
+
+      return send_message(sink, WebSocket::Text, "{\"error\":\"unknown command\"}");
+
+    default:
+      return true;
+    }
+  }
+
+  static bool fail(httplib::DataSink &sink, const char code[2])
+  {
+    send_message(sink, WebSocket::Close, std::string(code, 2));
+    return false;
+  }
+
+  // passes on control frames and whole messages, joining fragments; false
+  // once the connection should end
+  bool handle_frame(Client &client, httplib::DataSink &sink, bool fin, int opcode, std::string &payload)
+  {
+    if (opcode & 0x8)
+    {
+      if (!fin || payload.size() > WebSocket::max_control ||
+          (opcode != WebSocket::Close && opcode != WebSocket::Ping && opcode != WebSocket::Pong))
+        return fail(sink, WebSocket::protocol_error);
+
+      return handle_message(client, sink, opcode, payload);
+    }
+
+    if (opcode == WebSocket::Continuation)
+    {
+      if (!client.message_opcode)
+        return fail(sink, WebSocket::protocol_error);
+
+      if (client.message.size() + payload.size() > WebSocket::max_message)
+        return fail(sink, WebSocket::policy_violation);
+
+      client.message += payload;
+
+      if (!fin)
+        return true;
+
+      opcode = client.message_opcode;
+      payload.swap(client.message);
+      client.message_opcode = 0;
+      client.message.clear();
+      return handle_message(client, sink, opcode, payload);
+    }
+
+    if ((opcode != WebSocket::Text && opcode != WebSocket::Binary) || client.message_opcode)
+      return fail(sink, WebSocket::protocol_error);
+
+    if (!fin)
+    {
+      client.message_opcode = opcode;
+      client.message = payload;
+      return true;
+    }
+
+    return handle_message(client, sink, opcode, payload);
+  }
+
+  // reads whatever the client has sent without waiting
+  bool read_messages(Client &client, httplib::DataSink &sink, int sock)
+  {
+    char buf[1024];
+
+    for (;;)
+    {
+      ssize_t n = ::recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+
+      if (n == 0)
+        return false;
+
+      if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+      client.in.append(buf, n);
+
+      bool fin;
+      int opcode;
+      std::string payload;
+      const char *error;
+
+      while (WebSocket::parse_frame(client.in, fin, opcode, payload, error))
+      {
+        if (!handle_frame(client, sink, fin, opcode, payload))
+          return false;
+      }
+
+      if (error)
+        return fail(sink, error);
+    }
+  }
+
+  bool write_part(Client &client, httplib::DataSink &sink, const Part_h &part)
+  {
+    const Camera::ImageData &data = *part->frame->data;
+
+    if (!sink.socket)
+    {
+      return sink.write(part->prefix.data(), part->prefix.size()) &&
+             sink.write(data.data(), data.size());
+    }
+
+    struct iovec iov[2];
+
+    iov[0].iov_base = const_cast<char *>(part->prefix.data());
+    iov[0].iov_len = part->prefix.size();
+    iov[1].iov_base = const_cast<char *>(data.data());
+    iov[1].iov_len = data.size();
+
+    return httplib::detail::send_socket_vectored(sink.socket(), iov, 2, MSG_NOSIGNAL);
+  }
+
+  static bool is_upgrade(const httplib::Request &req)
+  {
+    return httplib::detail::case_ignore::equal(req.get_header_value("Upgrade"), "websocket") &&
+           req.has_header("Sec-WebSocket-Key");
+  }
+
+  void serve(const httplib::Request &req, httplib::Response &res)
+  {
+    if (!is_upgrade(req))
+    {
+      _rejected++;
+      res.status = httplib::StatusCode::BadRequest_400;
+      return;
+    }
+
+    if (req.get_header_value("Sec-WebSocket-Version") != "13")
+    {
+      _rejected++;
+      res.status = httplib::StatusCode::UpgradeRequired_426;
+      res.set_header("Sec-WebSocket-Version", "13");
+      return;
+    }
+
+    _handshakes++;
+
+    Client_h client = subscribe(req.remote_addr + ":" + std::to_string(req.remote_port));
+
+    res.status = httplib::StatusCode::SwitchingProtocol_101;
+
+    res.set_content_provider(
+      "",
+      [this, client](size_t offset, httplib::DataSink &sink) {
+        if (sink.socket && !read_messages(*client, sink, sink.socket()))
+          return false;
+
+        Part_h part = client->take(std::chrono::milliseconds(100));
+
+        if (!part)
+          return true;
+
+        int fps = client->fps;
+        auto now = std::chrono::steady_clock::now();
+
+        if (fps > 0 && now - client->last_sent < std::chrono::microseconds(1000000 / fps))
+        {
+          client->dropped++;
+          return true;
+        }
+
+        if (!write_part(*client, sink, part))
+          return false;
+
+        client->last_sent = now;
+        client->sent++;
+        return true;
+      },
+      [this, client](bool success) {
+        unsubscribe(client);
+      });
+
+    // the upgrade response has no body framing
+    res.headers.erase("Content-Type");
+    res.set_header("Upgrade", "websocket");
+    res.set_header("Connection", "Upgrade");
+    res.set_header("Sec-WebSocket-Accept", WebSocket::accept_key(req.get_header_value("Sec-WebSocket-Key")));
+  }
+
+  std::string stats()
+  {
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(_clientsMutex);
+
+    out << "rjpg_ws_clients " << _clients.size() << "\n";
+    out << "rjpg_ws_handshakes_total " << _handshakes << "\n";
+    out << "rjpg_ws_rejected_total " << _rejected << "\n";
+
+    for (auto &client : _clients)
+    {
+      out << "rjpg_ws_client_sent_frames{client=\"" << client->remote << "\"} " << client->sent << "\n";
+      out << "rjpg_ws_client_dropped_frames{client=\"" << client->remote << "\"} " << client->dropped << "\n";
+      out << "rjpg_ws_client_messages{client=\"" << client->remote << "\"} " << client->messages << "\n";
+    }
+
+    return out.str();
+  }
+};
+
+#endif
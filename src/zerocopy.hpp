@@ -0,0 +1,237 @@
+#ifndef _ZEROCOPY_HPP
+#define _ZEROCOPY_HPP
+
+#include "httpd.hpp"
+#include "rjpg-capture.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <string>
+
+extern "C" {
+  #include <poll.h>
+  #include <sys/socket.h>
+  #include <sys/uio.h>
+  #include <netinet/in.h>
+  #include <linux/errqueue.h>
+}
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+struct ZeroCopyStats
+{
+  std::atomic<uint64_t> zerocopy_bytes{0};
+  std::atomic<uint64_t> copied_bytes{0};
+  std::atomic<uint64_t> sends{0};
+  std::atomic<uint64_t> completions{0};
+  std::atomic<uint64_t> kernel_copied{0}; // completions the kernel had to copy after all
+  std::atomic<uint64_t> abandoned{0};     // still in flight when the socket went away
+
+  std::string stats(const char *prefix)
+  {
+    std::ostringstream out;
+
+    out << prefix << "_zerocopy_bytes_total " << zerocopy_bytes << "\n";
+    out << prefix << "_copied_bytes_total " << copied_bytes << "\n";
+    out << prefix << "_zerocopy_sends_total " << sends << "\n";
+    out << prefix << "_zerocopy_completions_total " << completions << "\n";
+    out << prefix << "_zerocopy_kernel_copied_total " << kernel_copied << "\n";
+    out << prefix << "_zerocopy_abandoned_total " << abandoned << "\n";
+
+    return out.str();
+  }
+};
+
+// Sends on one blocking socket with MSG_ZEROCOPY when a send is at least
+// the threshold, and with a regular copying sendmsg below it.
+//
+// With MSG_ZEROCOPY the kernel transmits straight from the caller's pages,
+// so the buffer must stay untouched until the kernel reports on the socket
+// error queue that it is done with it. Every zerocopy sendmsg call gets the
+// next id of a per socket counter, and a notification covers a range of
+// ids; the owner of each send's buffers is held here until its id has been
+// covered. Notifications are reaped after every send, and finish() waits a
+// little for the rest before the socket is closed.
+//
+// Over loopback, and on devices without scatter-gather, the kernel falls
+// back to copying; such notifications are counted as kernel_copied.
+struct ZeroCopySocket
+{
+  struct InFlight
+  {
+    uint32_t id;
+    std::shared_ptr<const void> owner;
+  };
+
+  int _sock;
+  size_t _threshold;
+  ZeroCopyStats &_stats;
+  bool _enabled = false;
+  uint32_t _nextId = 0;
+  std::deque<InFlight> _inFlight;
+
+  ZeroCopySocket(int sock, size_t threshold, ZeroCopyStats &stats)
+    : _sock(sock), _threshold(threshold), _stats(stats)
+  {
+    int one = 1;
+
+    if (setsockopt(_sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+      _enabled = true;
+    else
+      LogDeb("could not set SO_ZEROCOPY on socket %d: %d", _sock, errno);
+  }
+
+  ~ZeroCopySocket()
+  {
+    _stats.abandoned += _inFlight.size();
+  }
+
+  // sends every buffer, retrying on partial writes; owner keeps them alive
+  // until the kernel has let go of them
+  bool send(struct iovec *iov, int iovcnt, std::shared_ptr<const void> owner)
+  {
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+      total += iov[i].iov_len;
+
+    if (!_enabled || total < _threshold)
+    {
+      _stats.copied_bytes += total;
+      return httplib::detail::send_socket_vectored(_sock, iov, iovcnt, MSG_NOSIGNAL);
+    }
+
+    bool zerocopy_used = false;
+
+    while (iovcnt > 0)
+    {
+      struct msghdr msg = {0};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+
+      ssize_t n = httplib::detail::handle_EINTR([&]() { return sendmsg(_sock, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY); });
+
+      if (n < 0 && errno == ENOBUFS)
+      {
+        // too many notifications outstanding; copy this part instead
+        n = httplib::detail::handle_EINTR([&]() { return sendmsg(_sock, &msg, MSG_NOSIGNAL); });
+
+        if (n > 0)
+          _stats.copied_bytes += n;
+      }
+      else if (n > 0)
+      {
+        _stats.zerocopy_bytes += n;
+        _stats.sends++;
+        _nextId++;
+        zerocopy_used = true;
+      }
+
+      if (n <= 0)
+        return false;
+
+      size_t sent = n;
+
+      while (iovcnt > 0 && sent >= iov->iov_len)
+      {
+        sent -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+
+      if (iovcnt > 0)
+      {
+        iov->iov_base = (char *)iov->iov_base + sent;
+        iov->iov_len -= sent;
+      }
+    }
+
+    if (zerocopy_used)
+      _inFlight.push_back(InFlight{_nextId - 1, owner});
+
+    reap();
+    return true;
+  }
+
+  // releases the owners of every send the kernel has reported done
+  void reap()
+  {
+    while (!_inFlight.empty())
+    {
+      char control[128];
+      struct msghdr msg = {0};
+
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      if (recvmsg(_sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return;
+
+      for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+      {
+        if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+          continue;
+
+        const struct sock_extended_err *err = (const struct sock_extended_err *)CMSG_DATA(cm);
+
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+          continue;
+
+        // ids ee_info through ee_data are done; they wrap at 32 bits
+        uint32_t last = err->ee_data;
+
+        _stats.completions += last - err->ee_info + 1;
+
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+          _stats.kernel_copied += last - err->ee_info + 1;
+
+        while (!_inFlight.empty() && (int32_t)(last - _inFlight.front().id) >= 0)
+          _inFlight.pop_front();
+      }
+    }
+  }
+
+  // waits up to timeout for the outstanding notifications, before the
+  // socket is closed and they can no longer be received
+  void finish(std::chrono::milliseconds timeout)
+  {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    reap();
+
+    while (!_inFlight.empty())
+    {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+
+      if (left.count() <= 0)
+        break;
+
+      // the error queue signals POLLERR whatever events are asked for
+      struct pollfd pfd = {0};
+      pfd.fd = _sock;
+
+      if (::poll(&pfd, 1, (int)left.count()) <= 0)
+        break;
+
+      size_t outstanding = _inFlight.size();
+
+      reap();
+
+      // woken by something else, e.g. the peer going away
+      if (_inFlight.size() == outstanding)
+        break;
+    }
+  }
+};
+
+#endif